@@ -0,0 +1,182 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Guest-reported damage is often much coarser than what changed: the VGA
+ * models report whole dirty scanlines, some guests the whole screen on every
+ * frame. Keeping a shadow copy to compare against would cost a surface worth
+ * of memory, so instead a hash of each 64x64 tile is kept, and tiles in the
+ * damaged regions whose hash didn't change are dropped. This reads the
+ * damaged pixels once per refresh, which is much cheaper than sending them
+ * to the daemon when most of them didn't change.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "damage-refine.h"
+#include "mem-budget.h"
+
+void damage_refine_resize(DamageRefine *d, int width, int height)
+{
+    int cols = (width + DAMAGE_REFINE_TILE_SIZE - 1) / DAMAGE_REFINE_TILE_SIZE;
+    int rows = (height + DAMAGE_REFINE_TILE_SIZE - 1) / DAMAGE_REFINE_TILE_SIZE;
+    size_t size = (size_t) cols * rows * sizeof(*d->hash);
+
+    free(d->hash);
+    mem_budget_release(MEM_SCHED, d->size);
+    d->hash = NULL;
+    d->size = 0;
+    d->width = width;
+    d->height = height;
+    // without hashes the damage is passed through unchanged
+    if (size && mem_budget_reserve(MEM_SCHED, size)) {
+        d->hash = calloc(1, size);
+        if (d->hash)
+            d->size = size;
+        else
+            mem_budget_release(MEM_SCHED, size);
+    }
+    d->cols = d->hash ? cols : 0;
+    d->rows = d->hash ? rows : 0;
+}
+
+/* Free the hashes, damage passes through unchanged until the next
+ * damage_refine_resize() */
+void damage_refine_release(DamageRefine *d)
+{
+    free(d->hash);
+    mem_budget_release(MEM_SCHED, d->size);
+    d->hash = NULL;
+    d->size = 0;
+    d->cols = d->rows = 0;
+}
+
+void damage_refine_reset(DamageRefine *d)
+{
+    if (d->hash)
+        memset(d->hash, 0, d->size);
+}
+
+static uint64_t tile_hash(const DamageRefine *d, const uint8_t *data,
+                          int stride, int col, int row)
+{
+    int x0 = col * DAMAGE_REFINE_TILE_SIZE;
+    int y0 = row * DAMAGE_REFINE_TILE_SIZE;
+    int x1 = x0 + DAMAGE_REFINE_TILE_SIZE;
+    int y1 = y0 + DAMAGE_REFINE_TILE_SIZE;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int x, y;
+
+    if (x1 > d->width)
+        x1 = d->width;
+    if (y1 > d->height)
+        y1 = d->height;
+    for (y = y0; y < y1; y++) {
+        const uint32_t *p = (const uint32_t *) (data + (size_t) y * stride);
+
+        for (x = x0; x < x1; x++)
+            h = (h ^ p[x]) * 0x100000001b3ULL;
+    }
+    // 0 is reserved for "unknown"
+    return h ? h : 1;
+}
+
+/* Whether the tile changed since it was last hashed; true only the first time
+ * per refresh so that tiles overlapped by several regions are sent once */
+static bool tile_changed(DamageRefine *d, const uint8_t *data, int stride,
+                         int col, int row, uint8_t *seen)
+{
+    int i = row * d->cols + col;
+    uint64_t h;
+
+    if (seen[i])
+        return false;
+    seen[i] = 1;
+    h = tile_hash(d, data, stride, col, row);
+    if (h == d->hash[i])
+        return false;
+    d->hash[i] = h;
+    return true;
+}
+
+void damage_refine(DamageRefine *d, UpdateSched *s, const uint8_t *data,
+                   int stride)
+{
+    QubesGuiRect in[UPDATE_SCHED_MAX];
+    int n = s->npending, i;
+    uint8_t *seen;
+
+    for (i = 0; i < n; i++)
+        d->reported += (uint64_t) s->pending[i].w * s->pending[i].h * 4;
+    if (!d->hash || !n) {
+        for (i = 0; i < n; i++)
+            d->refined += (uint64_t) s->pending[i].w * s->pending[i].h * 4;
+        return;
+    }
+    seen = calloc((size_t) d->cols * d->rows, 1);
+    if (!seen)
+        return;
+    for (i = 0; i < n; i++)
+        in[i] = s->pending[i];
+    update_sched_clear(s);
+
+    for (i = 0; i < n; i++) {
+        QubesGuiRect *r = &in[i];
+        int x1 = r->x + r->w < d->width ? r->x + r->w : d->width;
+        int y1 = r->y + r->h < d->height ? r->y + r->h : d->height;
+        int c0 = (r->x > 0 ? r->x : 0) / DAMAGE_REFINE_TILE_SIZE;
+        int r0 = (r->y > 0 ? r->y : 0) / DAMAGE_REFINE_TILE_SIZE;
+        int c1 = (x1 - 1) / DAMAGE_REFINE_TILE_SIZE;
+        int r1 = (y1 - 1) / DAMAGE_REFINE_TILE_SIZE;
+        int row, col;
+
+        if (x1 <= r->x || y1 <= r->y)
+            continue;
+        for (row = r0; row <= r1; row++) {
+            int run = -1;
+
+            // one region per run of changed tiles; whole tiles are sent as
+            // the hash covers them, not only the reported part
+            for (col = c0; col <= c1 + 1; col++) {
+                bool changed = col <= c1 &&
+                    tile_changed(d, data, stride, col, row, seen);
+
+                if (changed && run < 0) {
+                    run = col;
+                } else if (!changed && run >= 0) {
+                    int x = run * DAMAGE_REFINE_TILE_SIZE;
+                    int y = row * DAMAGE_REFINE_TILE_SIZE;
+                    int w = (col - run) * DAMAGE_REFINE_TILE_SIZE;
+                    int h = DAMAGE_REFINE_TILE_SIZE;
+
+                    if (x + w > d->width)
+                        w = d->width - x;
+                    if (y + h > d->height)
+                        h = d->height - y;
+                    d->refined += (uint64_t) w * h * 4;
+                    update_sched_add(s, x, y, w, h);
+                    run = -1;
+                }
+            }
+        }
+    }
+    free(seen);
+}
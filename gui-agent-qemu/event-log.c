@@ -0,0 +1,168 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "event-log.h"
+#include "double-buffer.h"
+
+#define EVLOG_SIZE 512 /* records, must be a power of 2 */
+
+static const char *evlog_formats[EV_NR] = {
+    [EV_INIT_START] = "display init",
+    [EV_INIT_VERSION_SENT] = "version sent, waiting for xorg conf",
+    [EV_INIT_XCONF] = "got xorg conf %dx%d depth %d mem %d, creating window",
+    [EV_INIT_DONE] = "connection ready, surface %dx%d",
+    [EV_DISCONNECT] = "viewer disconnected",
+    [EV_QUEUE_STATS] = "outbound queue: %d KiB sent, %d allocations, "
+        "%d KiB copied, peak %d bytes queued, peak buffer %d bytes",
+    [EV_RATE_STATS] = "rate limit: %d hot tiles, %d regions held back, "
+        "%d paced updates, %d messages saved",
+    [EV_CONFIGURE] = "configure msg, x/y %d %d (was %d %d), w/h %d %d",
+    [EV_RESIZE] = "handle resize  w=%d h=%d",
+    [EV_KEY] = "received keycode %d(0x%x), converted to %d(0x%x) "
+               "qcode %d, release %d",
+    [EV_BUTTON] = "send buttonevent, type=%d button=%d",
+    [EV_KEYMAP_SYNC] = "handle_keymap_notify: sending key %d, down %d",
+};
+
+static const char *evlog_category_names[EVLOG_CATEGORY_NR] = {
+    [EVLOG_INIT] = "init",
+    [EVLOG_CONFIGURE] = "configure",
+    [EVLOG_RESIZE] = "resize",
+    [EVLOG_INPUT] = "input",
+};
+
+const uint8_t evlog_event_category[EV_NR] = {
+    [EV_INIT_START] = EVLOG_INIT,
+    [EV_INIT_VERSION_SENT] = EVLOG_INIT,
+    [EV_INIT_XCONF] = EVLOG_INIT,
+    [EV_INIT_DONE] = EVLOG_INIT,
+    [EV_DISCONNECT] = EVLOG_INIT,
+    [EV_QUEUE_STATS] = EVLOG_INIT,
+    [EV_RATE_STATS] = EVLOG_INIT,
+    [EV_CONFIGURE] = EVLOG_CONFIGURE,
+    [EV_RESIZE] = EVLOG_RESIZE,
+    [EV_KEY] = EVLOG_INPUT,
+    [EV_BUTTON] = EVLOG_INPUT,
+    [EV_KEYMAP_SYNC] = EVLOG_INPUT,
+};
+
+unsigned int evlog_mask;
+static struct evlog_record evlog_ring[EVLOG_SIZE];
+static uint64_t evlog_head;
+static int evlog_dump_at_exit_always;
+
+static uint64_t evlog_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void evlog_emit(enum evlog_event event, const int32_t *arg)
+{
+    uint64_t slot = __atomic_fetch_add(&evlog_head, 1, __ATOMIC_RELAXED);
+    struct evlog_record *rec = &evlog_ring[slot & (EVLOG_SIZE - 1)];
+    int i;
+
+    rec->ts_ns = evlog_clock();
+    rec->event = event;
+    for (i = 0; i < EVLOG_ARGS; i++)
+        rec->arg[i] = arg[i];
+}
+
+void evlog_set_mask(unsigned int mask)
+{
+    evlog_mask = mask & EVLOG_ALL;
+}
+
+static void evlog_format(FILE *f, const struct evlog_record *rec)
+{
+    if (rec->event >= EV_NR)
+        return;
+    fprintf(f, "qubes_gui[%llu.%06llu] %s: ",
+            (unsigned long long) (rec->ts_ns / 1000000000ULL),
+            (unsigned long long) (rec->ts_ns % 1000000000ULL) / 1000,
+            evlog_category_names[evlog_event_category[rec->event]]);
+    fprintf(f, evlog_formats[rec->event], rec->arg[0], rec->arg[1],
+            rec->arg[2], rec->arg[3], rec->arg[4], rec->arg[5]);
+    fputc('\n', f);
+}
+
+// Print all records still in the ring, oldest first, and empty it.
+void evlog_dump(FILE *f)
+{
+    uint64_t head = __atomic_load_n(&evlog_head, __ATOMIC_ACQUIRE);
+    uint64_t i = head > EVLOG_SIZE ? head - EVLOG_SIZE : 0;
+    static uint64_t dumped;
+
+    if (i < dumped)
+        i = dumped;
+    for (; i < head; i++)
+        evlog_format(f, &evlog_ring[i & (EVLOG_SIZE - 1)]);
+    dumped = head;
+    fflush(f);
+}
+
+// Must be called by the owner of the outbound double buffer.
+void evlog_queue_stats(void)
+{
+    struct double_buffer_stats st;
+
+    double_buffer_get_stats(&st);
+    evlog(EV_QUEUE_STATS, st.appended >> 10, st.allocations, st.copied >> 10,
+          st.peak_data, st.peak_size);
+}
+
+void evlog_set_dump_at_exit(int enabled)
+{
+    evlog_dump_at_exit_always = enabled;
+}
+
+#ifdef __GLIBC__
+static void evlog_dump_at_exit(int status, void *arg)
+{
+    if (status || evlog_dump_at_exit_always)
+        evlog_dump(stderr);
+}
+#else
+static void evlog_dump_at_exit(void)
+{
+    if (evlog_dump_at_exit_always)
+        evlog_dump(stderr);
+}
+#endif
+
+void evlog_init(unsigned int mask, int dump_at_exit)
+{
+    evlog_set_mask(mask);
+    evlog_set_dump_at_exit(dump_at_exit);
+    // the agent terminates with exit(1) on fatal vchan/allocation errors;
+    // this gives the history leading up to it. Without on_exit() the status
+    // isn't known and the ring is only dumped when asked to.
+#ifdef __GLIBC__
+    on_exit(evlog_dump_at_exit, NULL);
+#else
+    atexit(evlog_dump_at_exit);
+#endif
+}
@@ -0,0 +1,339 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Optional mode in which a dedicated thread owns the vchan, so a slow GUI
+ * daemon or a large grant ref dump never blocks the QEMU main loop.
+ *
+ * The main loop and the I/O thread only talk through two lock-free
+ * single-producer/single-consumer queues:
+ *  - outbound: chunks of protocol data produced by write_data() on the main
+ *    loop (redirected with txrx_set_write_redirect()),
+ *  - inbound: complete, decoded messages read from the daemon, handed to the
+ *    main loop through a bottom half.
+ * The connection handshake and reconnects are handled by the I/O thread;
+ * the main loop learns about them from the QUBESGUI_IO_* pseudo messages.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include <poll.h>
+
+#include "qubes-gui-io.h"
+#include "txrx.h"
+#include "double-buffer.h"
+#include "mem-budget.h"
+#include "event-log.h"
+#include "trace.h"
+
+typedef struct SpscNode {
+    struct SpscNode *next;
+} SpscNode;
+
+/* Unbounded SPSC queue, the consumer always keeps the last popped node as
+ * the list head and frees it on the next pop. */
+typedef struct SpscQueue {
+    SpscNode *head; /* consumer side */
+    SpscNode *tail; /* producer side */
+    SpscNode stub;
+} SpscQueue;
+
+static void spsc_init(SpscQueue *q)
+{
+    q->stub.next = NULL;
+    q->head = q->tail = &q->stub;
+}
+
+static void spsc_push(SpscQueue *q, SpscNode *node)
+{
+    node->next = NULL;
+    qatomic_store_release(&q->tail->next, node);
+    q->tail = node;
+}
+
+static SpscNode *spsc_pop(SpscQueue *q)
+{
+    SpscNode *head = q->head;
+    SpscNode *next = qatomic_load_acquire(&head->next);
+
+    if (!next)
+        return NULL;
+    q->head = next;
+    if (head != &q->stub)
+        g_free(head);
+    return next;
+}
+
+typedef struct QubesGuiOutChunk {
+    SpscNode node;
+    unsigned int epoch;
+    int size;
+    char data[];
+} QubesGuiOutChunk;
+
+struct QubesGuiIO {
+    QemuThread thread;
+    libvchan_t *vchan;
+    EventNotifier wakeup;
+    QEMUBH *bh;
+
+    SpscQueue out;
+    SpscQueue in;
+    /* outbound chunks pushed since the I/O thread last looked */
+    int out_pending;
+    /* bytes not yet handed to the vchan: in the queue / in the double
+     * buffer */
+    int out_queued;
+    int out_buffered;
+
+    /* Incremented by the I/O thread on every reconnect. Chunks produced
+     * by the main loop before it saw QUBESGUI_IO_DISCONNECT belong to the
+     * old connection and are dropped. */
+    unsigned int epoch;
+    unsigned int producer_epoch;
+
+    /* Stream positions in bytes produced by the main loop: how much it
+     * wrote, and how much of that the I/O thread popped / handed to the
+     * vchan (published with the time it happened). */
+    uint64_t produced;
+    uint64_t popped;
+    uint64_t sent;
+    int64_t sent_ns;
+
+    /* I/O thread only */
+    struct msg_hdr hdr;
+    int data_to_discard;
+    bool got_xconf;
+};
+
+/* Only one agent instance exists, write_data() has no context argument. */
+static QubesGuiIO *qubesgui_io;
+
+static int qubesgui_io_write(char *buf, int size)
+{
+    QubesGuiIO *io = qubesgui_io;
+    QubesGuiOutChunk *chunk;
+
+    if (!size)
+        return 0;
+    chunk = g_malloc(sizeof(*chunk) + size);
+    mem_budget_add(MEM_QUEUE, sizeof(*chunk) + size);
+    chunk->epoch = io->producer_epoch;
+    chunk->size = size;
+    memcpy(chunk->data, buf, size);
+    io->produced += size;
+    qatomic_add(&io->out_queued, size);
+    spsc_push(&io->out, &chunk->node);
+    if (qatomic_fetch_inc(&io->out_pending) == 0)
+        event_notifier_set(&io->wakeup);
+    return size;
+}
+
+static void qubesgui_io_post(QubesGuiIO *io, uint32_t type,
+                             QubesGuiPayload *payload)
+{
+    QubesGuiInMsg *msg = g_new0(QubesGuiInMsg, 1);
+
+    msg->received_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    msg->hdr = io->hdr;
+    msg->hdr.type = type;
+    if (payload)
+        msg->payload = *payload;
+    if (type == QUBESGUI_IO_DISCONNECT)
+        msg->hdr.untrusted_len = io->epoch;
+    spsc_push(&io->in, (SpscNode *) msg);
+}
+
+static void qubesgui_io_handshake(QubesGuiIO *io)
+{
+    uint32_t version = QUBES_GUI_PROTOCOL_VERSION_STUBDOM;
+
+    io->hdr.type = 0;
+    /* -1 to distinguish between "0 bytes to discard" and "do not
+     * discard this data" */
+    io->data_to_discard = -1;
+    io->got_xconf = false;
+    /* Straight to the vchan: write_data() would push it to the outbound
+     * queue, of which only the main loop may be the producer (and with the
+     * epoch of the previous connection). */
+    write_data_queued(io->vchan, (char *) &version, sizeof(version));
+    write_data_queued(io->vchan, NULL, 0);
+}
+
+static void qubesgui_io_reconnect(QubesGuiIO *io)
+{
+    QubesGuiOutChunk *chunk;
+
+    evlog_queue_stats();
+    libvchan_close(io->vchan);
+    /* FIXME: 0 here is hardcoded remote domain */
+    io->vchan = peer_server_init(0, 6000);
+    io->epoch++;
+    /* anything still queued was meant for the old connection */
+    while ((chunk = (QubesGuiOutChunk *) spsc_pop(&io->out))) {
+        mem_budget_release(MEM_QUEUE, sizeof(*chunk) + chunk->size);
+        qatomic_sub(&io->out_queued, chunk->size);
+        io->popped += chunk->size;
+    }
+    fprintf(stderr,
+            "qubes_gui: viewer disconnected, waiting for new connection\n");
+    qubesgui_io_post(io, QUBESGUI_IO_DISCONNECT, NULL);
+    qemu_bh_schedule(io->bh);
+    qubesgui_io_handshake(io);
+}
+
+static void qubesgui_io_flush(QubesGuiIO *io)
+{
+    QubesGuiOutChunk *chunk;
+    uint64_t sent;
+
+    qatomic_set(&io->out_pending, 0);
+    while ((chunk = (QubesGuiOutChunk *) spsc_pop(&io->out))) {
+        if (chunk->epoch == io->epoch)
+            write_data_queued(io->vchan, chunk->data, chunk->size);
+        mem_budget_release(MEM_QUEUE, sizeof(*chunk) + chunk->size);
+        qatomic_sub(&io->out_queued, chunk->size);
+        io->popped += chunk->size;
+    }
+    // trigger write of queued data, if any present
+    write_data_queued(io->vchan, NULL, 0);
+    qatomic_set(&io->out_buffered, double_buffer_datacount());
+
+    // the handshake may add a few bytes of its own to the double buffer,
+    // which makes this lag slightly
+    sent = io->popped - MIN(io->popped, (uint64_t) double_buffer_datacount());
+    if (sent > io->sent) {
+        qatomic_set(&io->sent_ns, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+        qatomic_store_release(&io->sent, sent);
+    }
+}
+
+static void qubesgui_io_receive(QubesGuiIO *io)
+{
+    QubesGuiPayload payload;
+    int posted = 0;
+
+    if (!io->got_xconf) {
+        if (!libvchan_data_ready(io->vchan))
+            return;
+        read_struct(io->vchan, payload.xconf);
+        io->got_xconf = true;
+        qubesgui_io_post(io, QUBESGUI_IO_XCONF, &payload);
+        posted++;
+    }
+    while (qubesgui_read_message(io->vchan, &io->hdr, &io->data_to_discard,
+                                 &payload)) {
+        qubesgui_io_post(io, io->hdr.type, &payload);
+        io->hdr.type = 0;
+        posted++;
+    }
+    if (posted)
+        qemu_bh_schedule(io->bh);
+}
+
+static void *qubesgui_io_thread(void *opaque)
+{
+    QubesGuiIO *io = opaque;
+    struct pollfd fds[2];
+
+    qubesgui_io_handshake(io);
+    for (;;) {
+        fds[0].fd = libvchan_fd_for_select(io->vchan);
+        fds[0].events = POLLIN;
+        fds[1].fd = event_notifier_get_fd(&io->wakeup);
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(1);
+        }
+        if (fds[1].revents)
+            event_notifier_test_and_clear(&io->wakeup);
+        if (fds[0].revents)
+            libvchan_wait(io->vchan);
+
+        if (io->got_xconf && !libvchan_is_open(io->vchan)) {
+            qubesgui_io_reconnect(io);
+            continue;
+        }
+        qubesgui_io_flush(io);
+        qubesgui_io_receive(io);
+    }
+    return NULL;
+}
+
+QubesGuiIO *qubesgui_io_thread_start(int domid, void (*notify)(void *),
+                                     void *opaque)
+{
+    QubesGuiIO *io = g_new0(QubesGuiIO, 1);
+
+    spsc_init(&io->out);
+    spsc_init(&io->in);
+    if (event_notifier_init(&io->wakeup, 0) < 0) {
+        fprintf(stderr, "qubes_gui: failed to create I/O thread notifier\n");
+        exit(1);
+    }
+    io->bh = qemu_bh_new(notify, opaque);
+    io->vchan = peer_server_init(domid, 6000);
+    qubesgui_io = io;
+    txrx_set_write_redirect(qubesgui_io_write);
+    qemu_thread_create(&io->thread, "qubes-gui-io", qubesgui_io_thread, io,
+                       QEMU_THREAD_DETACHED);
+    return io;
+}
+
+/* Main loop side. The returned message stays valid until the next call. */
+QubesGuiInMsg *qubesgui_io_thread_pop(QubesGuiIO *io)
+{
+    QubesGuiInMsg *msg = (QubesGuiInMsg *) spsc_pop(&io->in);
+
+    if (msg) {
+        trace_qubesgui_io_thread_dispatch(msg->hdr.type,
+            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - msg->received_ns);
+        if (msg->hdr.type == QUBESGUI_IO_DISCONNECT)
+            io->producer_epoch = msg->hdr.untrusted_len;
+    }
+    return msg;
+}
+
+int qubesgui_io_thread_queued(QubesGuiIO *io)
+{
+    return qatomic_read(&io->out_queued) + qatomic_read(&io->out_buffered);
+}
+
+uint64_t qubesgui_io_thread_stream_end(QubesGuiIO *io)
+{
+    return io->produced;
+}
+
+/* How much of the main loop output reached the vchan, and when the last
+ * bit of it did (approximately, the two are not updated atomically). */
+uint64_t qubesgui_io_thread_stream_sent(QubesGuiIO *io, int64_t *when_ns)
+{
+    uint64_t sent = qatomic_load_acquire(&io->sent);
+
+    *when_ns = qatomic_read(&io->sent_ns);
+    return sent;
+}
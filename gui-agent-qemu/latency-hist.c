@@ -0,0 +1,72 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency-hist.h"
+
+void latency_hist_add(LatencyHist *h, int64_t ns)
+{
+    uint64_t us = ns > 0 ? ns / 1000 : 0;
+    int bucket = 0;
+
+    while (bucket < LATENCY_HIST_BUCKETS - 1 && (us >> (bucket + 1)))
+        bucket++;
+    h->count[bucket]++;
+    h->samples++;
+    h->sum_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+void latency_hist_reset(LatencyHist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+// "samples=N avg_us=N max_us=N <2us:N <4us:N ...", empty buckets are
+// skipped; each bucket is labelled with its upper bound
+char *latency_hist_format(const LatencyHist *h)
+{
+    size_t size = 64 + LATENCY_HIST_BUCKETS * 32;
+    char *buf = malloc(size);
+    int len, i;
+
+    if (!buf)
+        return NULL;
+    len = snprintf(buf, size, "samples=%llu avg_us=%llu max_us=%llu",
+                   (unsigned long long) h->samples,
+                   (unsigned long long) (h->samples ?
+                                         h->sum_us / h->samples : 0),
+                   (unsigned long long) h->max_us);
+    for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        if (!h->count[i])
+            continue;
+        if (i == LATENCY_HIST_BUCKETS - 1)
+            len += snprintf(buf + len, size - len, " >=%lluus:%llu",
+                            1ULL << i, (unsigned long long) h->count[i]);
+        else
+            len += snprintf(buf + len, size - len, " <%lluus:%llu",
+                            1ULL << (i + 1), (unsigned long long) h->count[i]);
+    }
+    return buf;
+}
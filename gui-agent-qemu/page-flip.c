@@ -0,0 +1,129 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Tear-free output. The daemon copies from the granted pages whenever it
+ * gets MSG_SHMIMAGE, while the device model keeps drawing into the surface;
+ * content changing during that copy tears. With page flipping the surface
+ * itself is never shown. At the end of each refresh the damaged regions are
+ * copied into the back buffer, which is then announced with MSG_WINDOW_DUMP,
+ * so the pages the daemon reads from don't change until the next flip.
+ *
+ * Each buffer remembers what changed in the other one since it was written
+ * last, so only damaged regions are copied. The cost is two more surfaces
+ * worth of memory and the daemon remapping the grant refs on every frame.
+ */
+
+#include <string.h>
+#include "page-flip.h"
+#include "qubes-gui-qemu.h"
+
+static void copy_rect(const PageFlip *pf, uint8_t *dst, const uint8_t *src,
+                      int stride, const QubesGuiRect *r)
+{
+    int x0 = r->x > 0 ? r->x : 0;
+    int y0 = r->y > 0 ? r->y : 0;
+    int x1 = r->x + r->w < pf->width ? r->x + r->w : pf->width;
+    int y1 = r->y + r->h < pf->height ? r->y + r->h : pf->height;
+    int y;
+
+    for (y = y0; y < y1 && x0 < x1; y++)
+        memcpy(dst + (size_t) y * pf->width * 4 + x0 * 4,
+               src + (size_t) y * stride + x0 * 4, (x1 - x0) * 4);
+}
+
+void page_flip_free(PageFlip *pf)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        qubesgui_free_buffer_data(pf->buf[i].data, pf->width, pf->height,
+                                  pf->buf[i].refs);
+        pf->buf[i].data = NULL;
+        pf->buf[i].refs = NULL;
+        pf->buf[i].nstale = 0;
+    }
+    pf->width = pf->height = 0;
+}
+
+bool page_flip_resize(PageFlip *pf, int width, int height,
+                      const uint8_t *src, int stride)
+{
+    QubesGuiRect all = { 0, 0, width, height };
+    int i;
+
+    page_flip_free(pf);
+    for (i = 0; i < 2; i++) {
+        pf->buf[i].data = qubesgui_alloc_buffer_data(width, height,
+                                                     &pf->buf[i].refs);
+        if (!pf->buf[i].data) {
+            // free only what was allocated, with its size
+            pf->width = width;
+            pf->height = height;
+            page_flip_free(pf);
+            return false;
+        }
+    }
+    pf->width = width;
+    pf->height = height;
+    for (i = 0; i < 2; i++)
+        copy_rect(pf, pf->buf[i].data, src, stride, &all);
+    pf->front = 0;
+    return true;
+}
+
+bool page_flip_active(const PageFlip *pf)
+{
+    return pf->width != 0;
+}
+
+uint32_t *page_flip_front_refs(const PageFlip *pf)
+{
+    return pf->buf[pf->front].refs;
+}
+
+static void add_stale(PageFlipBuffer *b, const QubesGuiRect *r, int width,
+                      int height)
+{
+    if (b->nstale < PAGE_FLIP_STALE_MAX) {
+        b->stale[b->nstale++] = *r;
+        return;
+    }
+    b->stale[0] = (QubesGuiRect) { 0, 0, width, height };
+    b->nstale = 1;
+}
+
+void page_flip_frame(PageFlip *pf, const uint8_t *src, int stride,
+                     const QubesGuiRect *damage, int ndamage)
+{
+    PageFlipBuffer *front = &pf->buf[pf->front];
+    PageFlipBuffer *back = &pf->buf[!pf->front];
+    int i;
+
+    for (i = 0; i < back->nstale; i++)
+        copy_rect(pf, back->data, src, stride, &back->stale[i]);
+    back->nstale = 0;
+    for (i = 0; i < ndamage; i++) {
+        copy_rect(pf, back->data, src, stride, &damage[i]);
+        add_stale(front, &damage[i], pf->width, pf->height);
+    }
+    pf->front = !pf->front;
+}
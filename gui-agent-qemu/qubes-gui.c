@@ -7,6 +7,10 @@
 #include "ui/console.h"
 #include "ui/input.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qom/object.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 
 #include "qubes-gui-qemu.h"
 #include <qubes-gui-protocol.h>
@@ -14,6 +18,16 @@
 #include <xengnttab.h>
 #include <libvchan.h>
 #include "txrx.h"
+#include "double-buffer.h"
+#include "event-log.h"
+#include "qubes-gui-io.h"
+#include "update-sched.h"
+#include "latency-hist.h"
+#include "mem-budget.h"
+#include "page-flip.h"
+#include "damage-refine.h"
+#include "screen-sync.h"
+#include "trace.h"
 
 /* from /usr/include/X11/X.h */
 #define KeyPress               2
@@ -33,25 +47,59 @@
 #define Mod5Mask        (1<<7)
 
 
-/* from /usr/include/X11/Xutil.h */
-#define PPosition       (1L << 2) /* program specified position */
-#define PSize           (1L << 3) /* program specified size */
-#define PMinSize        (1L << 4) /* program specified minimum size */
-#define PMaxSize        (1L << 5) /* program specified maximum size */
-#define PResizeInc      (1L << 6) /* program specified resize increments */
-#define PAspect         (1L << 7) /* program specified min and max aspect ratios */
-#define PBaseSize       (1L << 8) /* program specified base for incrementing */
-#define PWinGravity     (1L << 9) /* program specified window gravity */
+/* Let a dedicated thread own the vchan instead of the QEMU main loop,
+ * see io-thread.c */
+#ifndef QUBES_GUI_IOTHREAD
+#define QUBES_GUI_IOTHREAD 0
+#endif
+
+/* Show the daemon a copy of the surface updated once per refresh instead of
+ * the surface itself, see page-flip.c. Can be toggled at runtime with the
+ * page-flip property */
+#ifndef QUBES_GUI_PAGE_FLIP
+#define QUBES_GUI_PAGE_FLIP 0
+#endif
+
+/* Drop the parts of the guest-reported damage that didn't change, see
+ * damage-refine.c. Can be toggled at runtime with the refine-damage property */
+#ifndef QUBES_GUI_REFINE_DAMAGE
+#define QUBES_GUI_REFINE_DAMAGE 0
+#endif
+
+/* Memory the agent may allocate (surfaces, queues, ...), 0 for no limit. Can
+ * be changed at runtime through the mem-limit property, see mem-budget.c */
+#ifndef QUBES_GUI_MEM_LIMIT
+#define QUBES_GUI_MEM_LIMIT (128 << 20)
+#endif
 
 // qubesgui_alloc_surface_data() has no ref to the gui state and is used before
 // initializing the display so this needs to be global.
 uint32_t qubesgui_domid = ~0;
 
+/* Tunables, changed at runtime through the qubes-gui object properties; a
+ * change takes effect at the next refresh. */
+typedef struct QubesGuiProfile {
+    uint32_t refresh_min_ms;    /* refresh interval with damage */
+    uint32_t refresh_max_ms;    /* ... backing off to this while idle */
+    uint32_t max_pending;       /* regions collected per refresh */
+    uint32_t rate_cap_hz;
+    uint32_t focus_ms;
+    uint32_t repaint_queue_max;
+    uint32_t batch_max_us;
+    uint32_t log_level;
+    bool filter_spurious;       /* drop one-line updates */
+    bool refine_damage;         /* send only tiles which changed */
+    bool page_flip;             /* tear-free output, see page-flip.c */
+} QubesGuiProfile;
+
 typedef struct QubesGuiState {
     DisplayChangeListener dcl;
-    DisplaySurface *surface;
+    /* the outbound side, see screen-sync.c */
+    ScreenSync sync;
     int log_level;
-    libvchan_t *vchan;
+    /* when set, the vchan is owned by the I/O thread and sync.vchan is
+     * unused */
+    QubesGuiIO *io;
     /* current message, keep here b/c  */
     struct msg_hdr hdr;
     /* amount of data to discard */
@@ -59,159 +107,231 @@ typedef struct QubesGuiState {
 
     char *clipboard_data;
     int clipboard_data_len;
-    int x;
-    int y;
     int mouse_x;
     int mouse_y;
-    int init_done;
     int init_state;
     unsigned char local_keys[32];
     int led_state;
+    /* last keypress or click, see qubesgui_flush_updates() */
+    int64_t last_input_ns;
+    QubesGuiProfile profile;
+    /* as last set through QOM, applied by qubesgui_apply_profile() */
+    QubesGuiProfile profile_next;
+    bool profile_changed;
+    /* vchan writes (each a potential event channel notification) */
+    /* libvchan_write() calls per second, see update_write_rate() */
+    int64_t write_rate_since;
+    unsigned long long write_rate_writes;
+    unsigned long long write_rate_bytes;
+    unsigned long long write_rate_frames;
+    int write_rate;
+    /* page flips per second, see update_write_rate() */
+    int flip_rate;
+    /* input-to-display latency, see latency_input() */
+    int64_t lat_input_ns;
+    int64_t lat_damage_ns;
+    bool lat_damage_queued;
+    unsigned long long lat_wire_mark;
+    LatencyHist input_to_damage;
+    LatencyHist damage_to_wire;
+
+    /* resize debouncing, see qubesgui_pv_switch() */
+    QEMUTimer *resize_timer;
 } QubesGuiState;
 
-static void qubesgui_init_connection(QubesGuiState *qs);
-
-#define QUBES_GUI_PROTOCOL_VERSION_STUBDOM (1 << 16 | 0)
+// The only instance, for the txrx callbacks which take no context.
+static QubesGuiState *qubesgui_state;
 
-// Autogenerated keycode -> scancode map
-#include "qubes-keycode2scancode.c"
+static void qubesgui_init_connection(QubesGuiState *qs);
+static void qubesgui_connection_ready(QubesGuiState *qs,
+                                      struct msg_xconf *xconf);
 
-#define min(x,y) ((x)>(y)?(y):(x))
-#define QUBES_MAIN_WINDOW 1
+/* Write out everything queued by the current main loop callback, see
+ * VCHAN_BATCH_MAX_US. The I/O thread flushes on its own. */
+static void qubesgui_flush_vchan(QubesGuiState *qs)
+{
+    if (!qs->io)
+        write_data(qs->sync.vchan, NULL, 0);
+}
 
-static void process_pv_update(QubesGuiState * qs,
-                              int x, int y, int width, int height)
+/* Position of the end of our output in the outbound stream */
+static unsigned long long qubesgui_stream_end(QubesGuiState *qs)
 {
-    struct msg_shmimage mx;
-    struct msg_hdr hdr;
+    if (qs->io)
+        return qubesgui_io_thread_stream_end(qs->io);
+    return double_buffer_position();
+}
 
-    hdr.type = MSG_SHMIMAGE;
-    hdr.window = QUBES_MAIN_WINDOW;
-    mx.x = x;
-    mx.y = y;
-    mx.width = width;
-    mx.height = height;
-    write_message(qs->vchan, hdr, mx);
+/* How much of the outbound stream was handed to the vchan, and when */
+static unsigned long long qubesgui_stream_sent(QubesGuiState *qs,
+                                               int64_t *when_ns)
+{
+    if (qs->io)
+        return qubesgui_io_thread_stream_sent(qs->io, when_ns);
+    *when_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    return double_buffer_position() - double_buffer_datacount();
 }
 
+/*
+ * Input-to-display latency. An input event starts a sample, the next damage
+ * reported by the guest completes the input-to-damage part, and the moment
+ * the first MSG_SHMIMAGE queued after it is handed to the vchan completes
+ * the damage-to-wire part. Only one sample is in flight at a time, inputs
+ * arriving meanwhile don't start a new one.
+ */
+static void latency_input(QubesGuiState *qs, int64_t received_ns)
+{
+    qs->sync.refresh_active = true;
+    if (!qs->lat_input_ns)
+        qs->lat_input_ns = received_ns;
+}
 
-static void qubes_create_window(QubesGuiState * qs, int w, int h)
+static void latency_damage(void *opaque)
 {
-    struct msg_hdr hdr;
-    struct msg_create crt;
+    QubesGuiState *qs = opaque;
+    int64_t now;
 
-    // the following hopefully avoids missed damage events
-    hdr.type = MSG_CREATE;
-    hdr.window = QUBES_MAIN_WINDOW;
-    crt.width = w;
-    crt.height = h;
-    crt.parent = 0;
-    crt.x = 0;
-    crt.y = 0;
-    crt.override_redirect = 0;
-    write_message(qs->vchan, hdr, crt);
+    if (!qs->lat_input_ns)
+        return;
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    latency_hist_add(&qs->input_to_damage, now - qs->lat_input_ns);
+    qs->lat_input_ns = 0;
+    if (!qs->lat_damage_ns) {
+        qs->lat_damage_ns = now;
+        qs->lat_damage_queued = false;
+    }
 }
 
-static void send_pixmap_grant_refs(QubesGuiState * qs)
+static void latency_check_wire(QubesGuiState *qs)
 {
-    size_t n;
-    struct msg_hdr hdr;
-    struct msg_window_dump_hdr wd_hdr;
+    int64_t when;
 
-    if (surface_xen_refs(qs->surface) == NULL) {
-        fprintf(stderr, "Can't dump surface without grant refs allocation!\n");
+    if (!qs->lat_damage_queued)
         return;
-    }
+    if (qubesgui_stream_sent(qs, &when) < qs->lat_wire_mark)
+        return;
+    latency_hist_add(&qs->damage_to_wire, when - qs->lat_damage_ns);
+    qs->lat_damage_ns = 0;
+    qs->lat_damage_queued = false;
+}
+
+static void latency_update_queued(void *opaque)
+{
+    QubesGuiState *qs = opaque;
 
-    n = ((surface_width(qs->surface) * surface_height(qs->surface) * 4) +
-         XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+    if (!qs->lat_damage_ns || qs->lat_damage_queued)
+        return;
+    qs->lat_wire_mark = qubesgui_stream_end(qs);
+    qs->lat_damage_queued = true;
+    latency_check_wire(qs);
+}
 
-    hdr.type = MSG_WINDOW_DUMP;
-    hdr.window = QUBES_MAIN_WINDOW;
-    hdr.untrusted_len = MSG_WINDOW_DUMP_HDR_LEN + n * SIZEOF_GRANT_REF;
+static void latency_reset_samples(QubesGuiState *qs)
+{
+    qs->lat_input_ns = 0;
+    qs->lat_damage_ns = 0;
+    qs->lat_damage_queued = false;
+}
 
-    wd_hdr.type = WINDOW_DUMP_TYPE_GRANT_REFS;
-    wd_hdr.width = surface_width(qs->surface);
-    wd_hdr.height = surface_height(qs->surface);
-    wd_hdr.bpp = 24;
+/* The outbound queue of the I/O thread, for screen-sync.c */
+static int qubesgui_io_queued(void *opaque)
+{
+    QubesGuiState *qs = opaque;
 
-    write_struct(qs->vchan, hdr);
-    write_struct(qs->vchan, wd_hdr);
-    write_data(qs->vchan, (char *) surface_xen_refs(qs->surface),
-               n * SIZEOF_GRANT_REF);
+    return qubesgui_io_thread_queued(qs->io);
 }
 
-static void send_wmname(QubesGuiState * qs, const char *wmname)
+static unsigned long long qubesgui_io_stream_end(void *opaque)
 {
-    struct msg_hdr hdr;
-    struct msg_wmname msg;
-    strncpy(msg.data, wmname, sizeof(msg.data)-1);
-    hdr.window = QUBES_MAIN_WINDOW;
-    hdr.type = MSG_WMNAME;
-    write_message(qs->vchan, hdr, msg);
+    QubesGuiState *qs = opaque;
+
+    return qubesgui_io_thread_stream_end(qs->io);
 }
 
-static void send_wmhints(QubesGuiState * qs)
+static unsigned long long qubesgui_io_stream_sent(void *opaque)
 {
-    struct msg_hdr hdr;
-    struct msg_window_hints msg;
+    QubesGuiState *qs = opaque;
+    int64_t when;
 
-    // pass only some hints
-    msg.flags = (PMinSize | PMaxSize);
-    msg.min_width = surface_width(qs->surface);
-    msg.min_height = surface_height(qs->surface);
-    msg.max_width = surface_width(qs->surface);
-    msg.max_height = surface_height(qs->surface);
-    hdr.window = QUBES_MAIN_WINDOW;
-    hdr.type = MSG_WINDOW_HINTS;
-    write_message(qs->vchan, hdr, msg);
+    return qubesgui_io_thread_stream_sent(qs->io, &when);
 }
 
-static void send_map(QubesGuiState * qs)
+static const ScreenSyncOps sync_ops = {
+    .damage = latency_damage,
+    .update_queued = latency_update_queued,
+};
+
+static const ScreenSyncOps sync_io_ops = {
+    .queued = qubesgui_io_queued,
+    .stream_end = qubesgui_io_stream_end,
+    .stream_sent = qubesgui_io_stream_sent,
+    .damage = latency_damage,
+    .update_queued = latency_update_queued,
+};
+
+// Autogenerated keycode -> scancode map
+#include "qubes-keycode2scancode.c"
+
+#define min(x,y) ((x)>(y)?(y):(x))
+
+/* For this long after a keypress or click, damage near the pointer is sent
+ * before the rest. */
+#define INPUT_FOCUS_MS 500
+
+/* Screen tiles updated more often than this are sent at this rate, 0 turns
+ * rate limiting off. See update-sched.c. */
+#define UPDATE_RATE_CAP_HZ 25
+
+/* Outbound data is written to the vchan (and the daemon notified) once per
+ * main loop callback, but never held back longer than this. */
+#define VCHAN_BATCH_MAX_US 4000
+
+/* Full repaints are paced so that no more than this much is queued for the
+ * daemon at once, about half of the vchan ring. */
+#define REPAINT_QUEUE_MAX 2048
+
+/* Refresh interval bounds, the interval grows towards the maximum while the
+ * screen doesn't change. Both default to QEMU's GUI_REFRESH_INTERVAL_DEFAULT. */
+#define REFRESH_MIN_MS 30
+#define REFRESH_MAX_MS 30
+
+static void reset_resize_state(QubesGuiState * qs)
 {
-    struct msg_hdr hdr;
-    struct msg_map_info map_info;
+    timer_del(qs->resize_timer);
+    screen_sync_reset(&qs->sync);
+}
 
-    map_info.override_redirect = 0;
-    map_info.transient_for = 0;
-    hdr.type = MSG_MAP;
-    hdr.window = QUBES_MAIN_WINDOW;
-    write_message(qs->vchan, hdr, map_info);
+static void qubesgui_resize_timer(void *opaque)
+{
+    QubesGuiState *qs = opaque;
+
+    screen_sync_flush_resize(&qs->sync);
 }
 
-static void process_pv_resize(QubesGuiState * qs)
+/* Ask the guest (if its display driver supports it) to render at the size
+ * the window actually has in dom0. QEMU debounces the request. */
+static void qubesgui_set_ui_info(QubesGuiState * qs, int width, int height)
 {
-    if (!qs->surface) {
-        return;
-    }
+    QemuUIInfo info;
 
-    struct msg_hdr hdr;
-    struct msg_configure conf;
-    hdr.type = MSG_CONFIGURE;
-    hdr.window = QUBES_MAIN_WINDOW;
-    conf.x = qs->x;
-    conf.y = qs->y;
-    conf.width = surface_width(qs->surface);
-    conf.height = surface_height(qs->surface);
-    conf.override_redirect = 0;
-    if (qs->log_level > 1)
-        fprintf(stderr,
-                "handle resize  w=%d h=%d\n", conf.width, conf.height);
-    write_message(qs->vchan, hdr, conf);
-    send_pixmap_grant_refs(qs);
-    send_wmhints(qs);
+    if (!dpy_ui_info_supported(qs->dcl.con))
+        return;
+    if (!screen_sync_ui_info(&qs->sync, &width, &height))
+        return;
+    info = *dpy_get_ui_info(qs->dcl.con);
+    info.width = width;
+    info.height = height;
+    dpy_set_ui_info(qs->dcl.con, &info, true);
 }
 
-static void handle_configure(QubesGuiState * qs)
+static void handle_configure(QubesGuiState * qs, struct msg_configure *r)
 {
-    struct msg_configure r;
-    read_data(qs->vchan, (char *) &r, sizeof(r));
-    fprintf(stderr,
-            "configure msg, x/y %d %d (was %d %d), w/h %d %d\n",
-            r.x, r.y, qs->x, qs->y, r.width, r.height);
+    evlog(EV_CONFIGURE, r->x, r->y, qs->sync.x, qs->sync.y, r->width,
+          r->height);
 
-    qs->x = r.x;
-    qs->y = r.y;
+    qs->sync.x = r->x;
+    qs->sync.y = r->y;
+    qubesgui_set_ui_info(qs, r->width, r->height);
 }
 
 static int is_bitset(unsigned char *keys, int num)
@@ -227,28 +347,52 @@ static void setbit(unsigned char *keys, int num, int value)
         keys[num / 8] &= ~(1 << (num % 8));
 }
 
+/* X keycode to QKeyCode, using QEMU's linux -> qcode map (generated from
+ * keycodemapdb), then the scancode for keys missing there. */
+static QKeyCode keycode_to_qcode(int keycode, uint8_t scancode)
+{
+    QKeyCode qcode = Q_KEY_CODE_UNMAPPED;
+
+    // X evdev keycodes have an offset of 8
+    if (keycode >= 8 && keycode - 8 < qemu_input_map_linux_to_qcode_len)
+        qcode = qemu_input_map_linux_to_qcode[keycode - 8];
+    if (qcode == Q_KEY_CODE_UNMAPPED && scancode)
+        qcode = qemu_input_key_number_to_qcode(scancode);
+    return qcode;
+}
+
+// Queue a key event; the caller calls qemu_input_event_sync() once all
+// events of a message are queued. Keys are sent as QKeyCode, so that
+// virtio-input and USB keyboards get them without a detour through PS/2
+// scancodes. Keys QEMU has no QKeyCode for are dropped, QEMU doesn't take
+// key events as numbers.
 static void send_keycode(QubesGuiState * qs, int keycode, int release)
 {
+    KeyValue *key;
+    InputEvent *evt;
+
     if (keycode > 255 || keycode < 0) {
         fprintf(stderr, "invalid keycode %d\n", keycode);
         return;
     }
 
     uint8_t scancode = qubes_keycode2scancode[keycode];
+    QKeyCode qcode = keycode_to_qcode(keycode, scancode);
 
     setbit(qs->local_keys, keycode, !release);
 
-    if (qs->log_level > 1)
-        fprintf(stderr,
-                "Received keycode %d(0x%x), converted to %d(0x%x)\n",
-                keycode, keycode, scancode, scancode);
-    if (!scancode) {
-        fprintf(stderr, "Can't convert keycode %x to scancode\n",
-                keycode);
+    evlog(EV_KEY, keycode, keycode, scancode, scancode, qcode, release);
+    if (qcode == Q_KEY_CODE_UNMAPPED) {
+        trace_qubesgui_key_unmapped(keycode, scancode);
         return;
     }
 
-    qemu_input_event_send_key_number(qs->dcl.con, scancode, !release);
+    key = g_new0(KeyValue, 1);
+    key->type = KEY_VALUE_KIND_QCODE;
+    key->u.qcode.data = qcode;
+    evt = qemu_input_event_new_key(key, !release);
+    qemu_input_event_send(qs->dcl.con, evt);
+    qapi_free_InputEvent(evt);
 }
 
 static void qubesgui_pv_kbd_led_event(void *opaque, int led_state) {
@@ -268,47 +412,41 @@ static void sync_kbd_state(QubesGuiState * qs, int kbd_state) {
     }
 }
 
-static void handle_keypress(QubesGuiState * qs)
+static void handle_keypress(QubesGuiState * qs, struct msg_keypress *key)
 {
-    struct msg_keypress key;
-
-    read_data(qs->vchan, (char *) &key, sizeof(key));
-
-    if (key.keycode != 66 && key.keycode != 77)
-        sync_kbd_state(qs, key.state);
-    send_keycode(qs, key.keycode, key.type != KeyPress);
+    qs->last_input_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (key->keycode != 66 && key->keycode != 77)
+        sync_kbd_state(qs, key->state);
+    send_keycode(qs, key->keycode, key->type != KeyPress);
+    qemu_input_event_sync();
 }
 
-static void handle_button(QubesGuiState * qs)
+static void handle_button(QubesGuiState * qs, struct msg_button *key)
 {
-    struct msg_button key;
     int button = -1;
 
-    read_data(qs->vchan, (char *) &key, sizeof(key));
-    if (qs->log_level > 1)
-        fprintf(stderr,
-                "send buttonevent, type=%d button=%d\n",
-                (int) key.type, key.button);
+    evlog(EV_BUTTON, key->type, key->button);
+    qs->last_input_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
-    if (key.button == Button1)
+    if (key->button == Button1)
         button = INPUT_BUTTON_LEFT;
-    else if (key.button == Button3)
+    else if (key->button == Button3)
         button = INPUT_BUTTON_RIGHT;
-    else if (key.button == Button2)
+    else if (key->button == Button2)
         button = INPUT_BUTTON_MIDDLE;
-    else if (key.button == Button4)
+    else if (key->button == Button4)
         button = INPUT_BUTTON_WHEEL_UP;
-    else if (key.button == Button5)
+    else if (key->button == Button5)
         button = INPUT_BUTTON_WHEEL_DOWN;
 
-    sync_kbd_state(qs, key.state);
+    sync_kbd_state(qs, key->state);
     if (button != -1) {
-        qemu_input_queue_btn(qs->dcl.con, button, key.type == ButtonPress);
-        qemu_input_event_sync();
+        qemu_input_queue_btn(qs->dcl.con, button, key->type == ButtonPress);
     } else {
         fprintf(stderr, "send buttonevent: unknown button %d\n",
-                key.button);
+                key->button);
     }
+    qemu_input_event_sync();
 }
 
 static void qubesgui_pv_mouse_set(DisplayChangeListener *dcl,
@@ -319,17 +457,15 @@ static void qubesgui_pv_mouse_set(DisplayChangeListener *dcl,
     qs->mouse_y = y;
 }
 
-static void handle_motion(QubesGuiState * qs)
+static void handle_motion(QubesGuiState * qs, struct msg_motion *key)
 {
-    struct msg_motion key;
     int new_x, new_y, w, h;
 
-    read_data(qs->vchan, (char *) &key, sizeof(key));
-    new_x = key.x;
-    new_y = key.y;
+    new_x = key->x;
+    new_y = key->y;
 
-    w = surface_width(qs->surface);
-    h = surface_height(qs->surface);
+    w = qs->sync.surface.width;
+    h = qs->sync.surface.height;
 
     if (new_x >= w)
         new_x = w - 1;
@@ -376,29 +512,25 @@ static bool is_simple_modifier_key(int keycode) {
     }
 }
 
-static void handle_keymap_notify(QubesGuiState * qs)
+static void handle_keymap_notify(QubesGuiState * qs,
+                                 unsigned char *remote_keys)
 {
     int i;
-    unsigned char remote_keys[32];
-    read_struct(qs->vchan, remote_keys);
     for (i = 0; i < 256; i++) {
         bool remote = is_bitset(remote_keys, i);
         bool local = is_bitset(qs->local_keys, i);
         if (remote != local && (!remote || is_simple_modifier_key(i))) {
             send_keycode(qs, i, !remote);
-            if (qs->log_level > 1)
-                fprintf(stderr,
-                        "handle_keymap_notify: sending key %d %s\n",
-                        i,
-                        is_bitset(remote_keys, i) ? "down" : "up");
+            evlog(EV_KEYMAP_SYNC, i, remote);
         }
     }
+    qemu_input_event_sync();
 }
 
-static void send_protocol_version(QubesGuiState *qs)
+static void qubesgui_send_protocol_version(libvchan_t *vchan)
 {
     uint32_t version = QUBES_GUI_PROTOCOL_VERSION_STUBDOM;
-    write_struct(qs->vchan, version);
+    write_struct(vchan, version);
 }
 
 
@@ -408,83 +540,190 @@ static void qubesgui_pv_update(DisplayChangeListener * dcl, int x, int y, int w,
                                int h)
 {
     QubesGuiState *qs = container_of(dcl, QubesGuiState, dcl);
-    if (!qs->init_done)
-        return;
-    // ignore one-line updates, Windows send them constantly at no reason
-    if (h == 1)
-        return;
-    process_pv_update(qs, x, y, w, h);
+
+    screen_sync_update(&qs->sync, x, y, w, h);
 }
 
 static void qubesgui_pv_switch(DisplayChangeListener * dcl, DisplaySurface * surface)
 {
     QubesGuiState *qs = container_of(dcl, QubesGuiState, dcl);
+    ScreenSyncSurface view;
+    int64_t deadline;
+
+    if (surface)
+        view = (ScreenSyncSurface) {
+            .data = surface_data(surface),
+            .width = surface_width(surface),
+            .height = surface_height(surface),
+            .stride = surface_stride(surface),
+            .refs = surface_xen_refs(surface),
+        };
+    deadline = screen_sync_switch(&qs->sync, surface ? &view : NULL,
+                                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    if (deadline)
+        timer_mod(qs->resize_timer, deadline);
+}
 
-    qs->surface = surface;
+/* The counters are updated by whichever thread writes to the vchan, so this
+ * works with and without the I/O thread. */
+static void update_write_rate(QubesGuiState * qs)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - qs->write_rate_since;
+    unsigned long long writes, bytes;
 
-    if (!qs->init_done)
+    if (elapsed < 1000)
         return;
+    txrx_get_write_stats(&writes, &bytes);
+    qs->write_rate = (writes - qs->write_rate_writes) * 1000 / elapsed;
+    trace_qubesgui_write_rate(qs->write_rate,
+        (int) (((bytes - qs->write_rate_bytes) * 1000 / elapsed) >> 10));
+    qs->write_rate_writes = writes;
+    qs->write_rate_bytes = bytes;
+    qs->flip_rate = (qs->sync.flip_frames - qs->write_rate_frames) * 1000 /
+        elapsed;
+    if (page_flip_active(&qs->sync.flip))
+        trace_qubesgui_page_flip_rate(qs->flip_rate, qs->sync.flip_deferred);
+    qs->write_rate_frames = qs->sync.flip_frames;
+    qs->write_rate_since = now;
+}
 
-    process_pv_resize(qs);
+/* Input events (keycodes) are only recorded when debugging was explicitly
+ * requested, the ring ends up in the stubdom console log. */
+static unsigned int evlog_mask_for_level(int log_level)
+{
+    if (log_level > 1)
+        return EVLOG_ALL;
+    return EVLOG_ALL & ~EVLOG_CAT(EVLOG_INPUT);
+}
+
+static ScreenSyncConfig qubesgui_sync_config(const QubesGuiProfile *p)
+{
+    return (ScreenSyncConfig) {
+        .max_pending = p->max_pending,
+        .rate_cap_hz = p->rate_cap_hz,
+        .repaint_queue_max = p->repaint_queue_max,
+        .filter_spurious = p->filter_spurious,
+        .refine_damage = p->refine_damage,
+        .page_flip = p->page_flip,
+    };
+}
+
+static void qubesgui_apply_profile(QubesGuiState * qs)
+{
+    QubesGuiProfile *p = &qs->profile;
+    ScreenSyncConfig config;
+
+    qs->profile = qs->profile_next;
+    qs->profile_changed = false;
+    if (p->refresh_max_ms < p->refresh_min_ms)
+        p->refresh_max_ms = p->refresh_min_ms;
+    // picked up when the next batch starts, by the I/O thread if there is one
+    txrx_set_write_batching(1, p->batch_max_us);
+    qs->log_level = p->log_level;
+    evlog_set_mask(evlog_mask_for_level(qs->log_level));
+    evlog_set_dump_at_exit(qs->log_level > 0);
+    update_displaychangelistener(&qs->dcl, p->refresh_min_ms);
+    config = qubesgui_sync_config(p);
+    screen_sync_configure(&qs->sync, &config);
+}
+
+/* Refresh at the minimum interval while anything changes (or the user
+ * interacts), back off towards the maximum while idle. */
+static void qubesgui_adjust_refresh(QubesGuiState * qs)
+{
+    QubesGuiProfile *p = &qs->profile;
+    uint64_t interval = qs->dcl.update_interval;
+
+    // update_interval is 0 until the first change
+    if (qs->sync.refresh_active || update_repaint_active(&qs->sync.repaint))
+        interval = p->refresh_min_ms;
+    else
+        interval = MIN(MAX(interval, p->refresh_min_ms) * 2,
+                       p->refresh_max_ms);
+    qs->sync.refresh_active = false;
+    if (interval != qs->dcl.update_interval)
+        update_displaychangelistener(&qs->dcl, interval);
 }
 
 static void qubesgui_pv_refresh(DisplayChangeListener * dcl)
 {
+    QubesGuiState *qs = container_of(dcl, QubesGuiState, dcl);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bool focus = now - qs->last_input_ns <
+        (int64_t) qs->profile.focus_ms * SCALE_MS;
+
+    if (qs->profile_changed)
+        qubesgui_apply_profile(qs);
+    // damage reported synchronously by the device model is collected and
+    // sent at once; updates from outside the refresh are sent right away
+    qs->sync.sched.batching = true;
     graphic_hw_update(dcl->con);
+    qs->sync.sched.batching = false;
+    screen_sync_refresh(&qs->sync, now / SCALE_MS, focus, qs->mouse_x,
+                        qs->mouse_y);
+    latency_check_wire(qs);
+    update_write_rate(qs);
+    qubesgui_adjust_refresh(qs);
 }
 
+/*
+ * Every surface must come from qubesgui_alloc_surface_data(), the daemon can
+ * only map pages this domain granted. Device memory (VRAM) of the HVM guest is
+ * mapped here as foreign memory and xengntshr can't share it, so scanout
+ * directly from VRAM isn't possible and the device model keeps copying damaged
+ * lines into the granted surface.
+ */
 static bool qubesgui_pv_check_format(DisplayChangeListener *dcl,
                                      pixman_format_code_t format)
 {
     return format == PIXMAN_x8r8g8b8;
 }
 
-static void qubesgui_message_handler(void *opaque)
+static int qubesgui_payload_size(uint32_t type)
 {
-    QubesGuiState *qs = opaque;
-    char discard[256];
-
-
-    libvchan_wait(qs->vchan);
-    if (!qs->init_done) {
-        qubesgui_init_connection(qs);
-        return;
-    }
-    if (!libvchan_is_open(qs->vchan)) {
-        qs->init_done = 0;
-        qs->init_state = 0;
-        qemu_set_fd_handler(libvchan_fd_for_select(qs->vchan),
-                            NULL, NULL, NULL);
-        libvchan_close(qs->vchan);
-        /* FIXME: 0 here is hardcoded remote domain */
-        qs->vchan = peer_server_init(0, 6000);
-        qemu_set_fd_handler(libvchan_fd_for_select(qs->vchan),
-                            qubesgui_message_handler, NULL, qs);
-        fprintf(stderr,
-                "qubes_gui: viewer disconnected, waiting for new connection\n");
-        return;
+    switch (type) {
+    case MSG_KEYPRESS:
+        return sizeof(struct msg_keypress);
+    case MSG_BUTTON:
+        return sizeof(struct msg_button);
+    case MSG_MOTION:
+        return sizeof(struct msg_motion);
+    case MSG_KEYMAP_NOTIFY:
+        return 32;
+    case MSG_CONFIGURE:
+        return sizeof(struct msg_configure);
+    default:
+        return 0;
     }
+}
 
-    // trigger write of queued data, if any present
-    write_data(qs->vchan, NULL, 0);
+/* Read from vchan until a complete supported message is available, skipping
+ * unsupported ones. Returns 1 with the header in hdr and the body in payload;
+ * the caller must reset hdr->type afterwards. Returns 0 if more data is
+ * needed. hdr and data_to_discard carry the state between calls. */
+int qubesgui_read_message(libvchan_t *vchan, struct msg_hdr *hdr,
+                          int *data_to_discard, QubesGuiPayload *payload)
+{
+    char discard[256];
 
-    while (libvchan_data_ready(qs->vchan) > 0) {
-        if (!qs->hdr.type) {
+    while (libvchan_data_ready(vchan) > 0) {
+        if (!hdr->type) {
             int hdr_size;
             /* read the header if not already done */
-            hdr_size = read_data(qs->vchan, (char *) &qs->hdr, sizeof(qs->hdr));
-            if (hdr_size != sizeof(qs->hdr)) {
+            hdr_size = read_data(vchan, (char *) hdr, sizeof(*hdr));
+            if (hdr_size != sizeof(*hdr)) {
                 fprintf(stderr,
                         "qubes_gui: got incomplete header (%d instead of %lu)\n",
-                        hdr_size, sizeof(qs->hdr));
+                        hdr_size, sizeof(*hdr));
             }
         }
 
-        if (qs->hdr.type && qs->vchan_data_to_discard < 0) {
+        if (hdr->type && *data_to_discard < 0) {
             /* got header, check the data */
 
             /* fast path for not supported messages */
-            switch (qs->hdr.type) {
+            switch (hdr->type) {
                 case MSG_KEYPRESS:
                 case MSG_BUTTON:
                 case MSG_MOTION:
@@ -495,7 +734,7 @@ static void qubesgui_message_handler(void *opaque)
                 default:
                     fprintf(stderr,
                             "qubes_gui: got unknown msg type %d, ignoring\n",
-                            qs->hdr.type);
+                            hdr->type);
                     /* fallthrough */
                 case MSG_CLIPBOARD_REQ:
                 case MSG_CLIPBOARD_DATA:
@@ -504,21 +743,21 @@ static void qubesgui_message_handler(void *opaque)
                 case MSG_CROSSING:
                 case MSG_FOCUS:
                 case MSG_EXECUTE:
-                    qs->vchan_data_to_discard = qs->hdr.untrusted_len;
+                    *data_to_discard = hdr->untrusted_len;
             }
         }
 
-        if (qs->vchan_data_to_discard >= 0) {
-            while (libvchan_data_ready(qs->vchan) && qs->vchan_data_to_discard) {
-                qs->vchan_data_to_discard -= libvchan_read(qs->vchan, discard,
-                        min(qs->vchan_data_to_discard, sizeof(discard)));
+        if (*data_to_discard >= 0) {
+            while (libvchan_data_ready(vchan) && *data_to_discard) {
+                *data_to_discard -= libvchan_read(vchan, discard,
+                        min(*data_to_discard, sizeof(discard)));
             }
-            if (!qs->vchan_data_to_discard) {
+            if (!*data_to_discard) {
                 /* whole message "processed" */
-                qs->hdr.type = 0;
+                hdr->type = 0;
                 /* -1 to distinguish between "0 bytes to discard" and "do not
                  * discard this data" */
-                qs->vchan_data_to_discard = -1;
+                *data_to_discard = -1;
             }
             continue;
         }
@@ -527,36 +766,134 @@ static void qubesgui_message_handler(void *opaque)
          * message) will fit into vchan buffer; for now it is true, but once
          * this agent will start support for bigger messages, some local
          * buffering needs to be done */
-        if (libvchan_data_ready(qs->vchan) < qs->hdr.untrusted_len) {
+        if (libvchan_data_ready(vchan) < hdr->untrusted_len) {
             /* wait for data */
-            return;
+            return 0;
         }
 
-        switch (qs->hdr.type) {
-        case MSG_KEYPRESS:
-            handle_keypress(qs);
-            break;
-        case MSG_BUTTON:
-            handle_button(qs);
-            break;
-        case MSG_MOTION:
-            handle_motion(qs);
-            break;
-        case MSG_KEYMAP_NOTIFY:
-            handle_keymap_notify(qs);
+        read_data(vchan, (char *) payload, qubesgui_payload_size(hdr->type));
+        return 1;
+    }
+    return 0;
+}
+
+static void qubesgui_dispatch(QubesGuiState *qs, struct msg_hdr *hdr,
+                              QubesGuiPayload *payload, int64_t received_ns)
+{
+    trace_qubesgui_handle_enter(hdr->type, hdr->untrusted_len);
+    switch (hdr->type) {
+    case MSG_KEYPRESS:
+        latency_input(qs, received_ns);
+        handle_keypress(qs, &payload->keypress);
+        break;
+    case MSG_BUTTON:
+        latency_input(qs, received_ns);
+        handle_button(qs, &payload->button);
+        break;
+    case MSG_MOTION:
+        latency_input(qs, received_ns);
+        handle_motion(qs, &payload->motion);
+        break;
+    case MSG_KEYMAP_NOTIFY:
+        handle_keymap_notify(qs, payload->keymap);
+        break;
+    case MSG_CONFIGURE:
+        handle_configure(qs, &payload->configure);
+        break;
+    default:
+        fprintf(stderr,
+                "BUG: qubes_gui: "
+                "got unknown msg type %d, but not ignored earlier\n",
+                hdr->type);
+        exit(1);
+    }
+    trace_qubesgui_handle_exit(hdr->type, screen_sync_queued(&qs->sync));
+}
+
+static void qubesgui_message_handler(void *opaque)
+{
+    QubesGuiState *qs = opaque;
+    QubesGuiPayload payload;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int handled = 0;
+
+    libvchan_wait(qs->sync.vchan);
+    if (!qs->sync.init_done) {
+        qubesgui_init_connection(qs);
+        return;
+    }
+    if (!libvchan_is_open(qs->sync.vchan)) {
+        evlog_queue_stats();
+        qs->init_state = 0;
+        qemu_set_fd_handler(libvchan_fd_for_select(qs->sync.vchan),
+                            NULL, NULL, NULL);
+        screen_sync_disconnect(&qs->sync);
+        qemu_set_fd_handler(libvchan_fd_for_select(qs->sync.vchan),
+                            qubesgui_message_handler, NULL, qs);
+        // the stubdom console is slow, see evlog_set_dump_at_exit()
+        if (qs->log_level > 0)
+            evlog_dump(stderr);
+        return;
+    }
+
+    // trigger write of queued data, if any present
+    write_data(qs->sync.vchan, NULL, 0);
+
+    while (qubesgui_read_message(qs->sync.vchan, &qs->hdr,
+                                 &qs->vchan_data_to_discard, &payload)) {
+        qubesgui_dispatch(qs, &qs->hdr, &payload,
+                          qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+        qs->hdr.type = 0;
+        handled++;
+    }
+    latency_check_wire(qs);
+    trace_qubesgui_main_loop_io(handled,
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+}
+
+/* Main loop side of the I/O thread mode, runs as a bottom half. */
+static void qubesgui_io_thread_handler(void *opaque)
+{
+    QubesGuiState *qs = opaque;
+    QubesGuiInMsg *msg;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int handled = 0;
+
+    while ((msg = qubesgui_io_thread_pop(qs->io))) {
+        switch (msg->hdr.type) {
+        case QUBESGUI_IO_DISCONNECT:
+            qs->init_state = 0;
+            screen_sync_disconnect(&qs->sync);
+            if (qs->log_level > 0)
+                evlog_dump(stderr);
             break;
-        case MSG_CONFIGURE:
-            handle_configure(qs);
+        case QUBESGUI_IO_XCONF:
+            reset_resize_state(qs);
+            qubesgui_connection_ready(qs, &msg->payload.xconf);
             break;
         default:
-            fprintf(stderr,
-                    "BUG: qubes_gui: "
-                    "got unknown msg type %d, but not ignored earlier\n",
-                    qs->hdr.type);
-            exit(1);
+            if (qs->sync.init_done)
+                qubesgui_dispatch(qs, &msg->hdr, &msg->payload,
+                                  msg->received_ns);
         }
-        qs->hdr.type = 0;
+        handled++;
     }
+    latency_check_wire(qs);
+    trace_qubesgui_main_loop_io(handled,
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+}
+
+static void qubesgui_queue_append(int size, int queued)
+{
+    trace_qubesgui_queue_append(size, queued);
+}
+
+static void qubesgui_queue_drain(int count, int queued)
+{
+    trace_qubesgui_queue_drain(count, queued);
+    // only the main loop writes to the vchan when there is no I/O thread
+    if (qubesgui_state && !qubesgui_state->io)
+        latency_check_wire(qubesgui_state);
 }
 
 static const DisplayChangeListenerOps dcl_ops = {
@@ -568,34 +905,372 @@ static const DisplayChangeListenerOps dcl_ops = {
     .dpy_mouse_set = qubesgui_pv_mouse_set
 };
 
-static void qubesgui_pv_display_init(DisplayState *ds, DisplayOptions *o)
+/*
+ * Runtime statistics and controls, as properties of /objects/qubes-gui:
+ *   qom-get /objects/qubes-gui input-to-damage
+ *   qom-set /objects/qubes-gui reset-latency true
+ */
+#define TYPE_QUBES_GUI "qubes-gui"
+OBJECT_DECLARE_SIMPLE_TYPE(QubesGuiObject, QUBES_GUI)
+
+struct QubesGuiObject {
+    Object parent_obj;
+    QubesGuiState *qs;
+};
+
+static char *qubes_gui_hist_string(const LatencyHist *h)
+{
+    char *text = latency_hist_format(h);
+    char *ret = g_strdup(text ? text : "");
+
+    free(text);
+    return ret;
+}
+
+static char *qubes_gui_get_input_to_damage(Object *obj, Error **errp)
+{
+    return qubes_gui_hist_string(&QUBES_GUI(obj)->qs->input_to_damage);
+}
+
+static char *qubes_gui_get_damage_to_wire(Object *obj, Error **errp)
+{
+    return qubes_gui_hist_string(&QUBES_GUI(obj)->qs->damage_to_wire);
+}
+
+static void qubes_gui_set_reset_latency(Object *obj, bool value, Error **errp)
 {
+    QubesGuiState *qs = QUBES_GUI(obj)->qs;
+
+    if (!value)
+        return;
+    latency_hist_reset(&qs->input_to_damage);
+    latency_hist_reset(&qs->damage_to_wire);
+    latency_reset_samples(qs);
+}
+
+static char *qubes_gui_get_memory(Object *obj, Error **errp)
+{
+    char *text = mem_budget_format();
+    char *ret = g_strdup(text ? text : "");
+
+    free(text);
+    return ret;
+}
+
+static char *qubes_gui_get_vchan_writes(Object *obj, Error **errp)
+{
+    QubesGuiState *qs = QUBES_GUI(obj)->qs;
+    unsigned long long writes, bytes;
+
+    txrx_get_write_stats(&writes, &bytes);
+    return g_strdup_printf("writes=%llu bytes=%llu writes_per_sec=%d",
+                           writes, bytes, qs->write_rate);
+}
+
+static char *qubes_gui_get_page_flips(Object *obj, Error **errp)
+{
+    QubesGuiState *qs = QUBES_GUI(obj)->qs;
+
+    return g_strdup_printf("frames=%llu deferred=%llu frames_per_sec=%d",
+                           qs->sync.flip_frames, qs->sync.flip_deferred,
+                           qs->flip_rate);
+}
+
+static void qubes_gui_get_mem_limit(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    uint64_t value = mem_budget_limit();
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void qubes_gui_set_mem_limit(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    uint64_t value;
+
+    if (!visit_type_uint64(v, name, &value, errp))
+        return;
+    mem_budget_set_limit(value);
+}
+
+typedef struct QubesGuiProfileParam {
+    const char *name;
+    size_t offset;
+    uint32_t min;
+    uint32_t max;
+    const char *description;
+} QubesGuiProfileParam;
+
+/* QEMU's gui_update() caps the refresh interval at GUI_REFRESH_INTERVAL_IDLE */
+static const QubesGuiProfileParam qubes_gui_profile_params[] = {
+    { "refresh-min-ms", offsetof(QubesGuiProfile, refresh_min_ms),
+      1, GUI_REFRESH_INTERVAL_IDLE,
+      "Refresh interval while the screen changes (ms)" },
+    { "refresh-max-ms", offsetof(QubesGuiProfile, refresh_max_ms),
+      1, GUI_REFRESH_INTERVAL_IDLE,
+      "Refresh interval the agent backs off to while idle (ms)" },
+    { "max-pending", offsetof(QubesGuiProfile, max_pending),
+      1, UPDATE_SCHED_MAX,
+      "Damaged regions kept per refresh before merging them" },
+    { "rate-cap-hz", offsetof(QubesGuiProfile, rate_cap_hz), 0, 1000,
+      "Update rate of fast changing screen tiles, 0 for no limit" },
+    { "focus-ms", offsetof(QubesGuiProfile, focus_ms), 0, 60000,
+      "Time after input during which damage near the pointer goes first" },
+    { "repaint-queue-max", offsetof(QubesGuiProfile, repaint_queue_max),
+      1, 1 << 20, "Outbound bytes queued at most by a full repaint" },
+    { "batch-max-us", offsetof(QubesGuiProfile, batch_max_us), 0, 1000000,
+      "Longest time outbound data is held back for batching (us)" },
+    { "log-level", offsetof(QubesGuiProfile, log_level), 0, 2,
+      "Debug log level, input is only logged above 1" },
+};
+
+static void qubes_gui_get_profile_param(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    const QubesGuiProfileParam *param = opaque;
+    QubesGuiState *qs = QUBES_GUI(obj)->qs;
+    uint32_t value = *(uint32_t *) ((char *) &qs->profile_next +
+                                    param->offset);
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void qubes_gui_set_profile_param(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    const QubesGuiProfileParam *param = opaque;
+    QubesGuiState *qs = QUBES_GUI(obj)->qs;
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp))
+        return;
+    if (value < param->min || value > param->max) {
+        error_setg(errp, "%s must be between %u and %u", name, param->min,
+                   param->max);
+        return;
+    }
+    *(uint32_t *) ((char *) &qs->profile_next + param->offset) = value;
+    qs->profile_changed = true;
+}
+
+static bool qubes_gui_get_filter_spurious(Object *obj, Error **errp)
+{
+    return QUBES_GUI(obj)->qs->profile_next.filter_spurious;
+}
+
+static void qubes_gui_set_filter_spurious(Object *obj, bool value,
+                                          Error **errp)
+{
+    QubesGuiState *qs = QUBES_GUI(obj)->qs;
+
+    qs->profile_next.filter_spurious = value;
+    qs->profile_changed = true;
+}
+
+static bool qubes_gui_get_page_flip(Object *obj, Error **errp)
+{
+    return QUBES_GUI(obj)->qs->profile_next.page_flip;
+}
+
+static void qubes_gui_set_page_flip(Object *obj, bool value, Error **errp)
+{
+    QubesGuiState *qs = QUBES_GUI(obj)->qs;
+
+    qs->profile_next.page_flip = value;
+    qs->profile_changed = true;
+}
+
+static bool qubes_gui_get_refine_damage(Object *obj, Error **errp)
+{
+    return QUBES_GUI(obj)->qs->profile_next.refine_damage;
+}
 
-    fprintf(stderr, "qubes_gui/init: %d\n", __LINE__);
+static void qubes_gui_set_refine_damage(Object *obj, bool value, Error **errp)
+{
+    QubesGuiState *qs = QUBES_GUI(obj)->qs;
+
+    qs->profile_next.refine_damage = value;
+    qs->profile_changed = true;
+}
+
+static char *qubes_gui_get_damage_bytes(Object *obj, Error **errp)
+{
+    DamageRefine *d = &QUBES_GUI(obj)->qs->sync.refine;
+
+    return g_strdup_printf("reported=%" PRIu64 " sent=%" PRIu64,
+                           d->reported, d->refined);
+}
+
+static void qubes_gui_set_dump_event_log(Object *obj, bool value,
+                                         Error **errp)
+{
+    if (value)
+        evlog_dump(stderr);
+}
+
+static void qubes_gui_set_check_resources(Object *obj, bool value,
+                                          Error **errp)
+{
+    if (value && screen_sync_check_resources(&QUBES_GUI(obj)->qs->sync))
+        error_setg(errp, "resource check failed, see the log");
+}
+
+static void qubes_gui_class_init(ObjectClass *oc, void *data)
+{
+    size_t i;
+
+    object_class_property_add_str(oc, "input-to-damage",
+                                  qubes_gui_get_input_to_damage, NULL);
+    object_class_property_set_description(oc, "input-to-damage",
+        "Time from an input event to the next guest damage");
+    object_class_property_add_str(oc, "damage-to-wire",
+                                  qubes_gui_get_damage_to_wire, NULL);
+    object_class_property_set_description(oc, "damage-to-wire",
+        "Time from guest damage to its MSG_SHMIMAGE reaching the vchan");
+    object_class_property_add_bool(oc, "reset-latency", NULL,
+                                   qubes_gui_set_reset_latency);
+    object_class_property_add_bool(oc, "dump-event-log", NULL,
+                                   qubes_gui_set_dump_event_log);
+    object_class_property_add_bool(oc, "check-resources", NULL,
+                                   qubes_gui_set_check_resources);
+    object_class_property_set_description(oc, "check-resources",
+        "Check for leaked grant pages and unaccounted outbound data");
+    object_class_property_add_str(oc, "vchan-writes",
+                                  qubes_gui_get_vchan_writes, NULL);
+    object_class_property_set_description(oc, "vchan-writes",
+        "libvchan_write() calls and bytes written, and the current rate");
+    object_class_property_add_str(oc, "page-flips",
+                                  qubes_gui_get_page_flips, NULL);
+    object_class_property_set_description(oc, "page-flips",
+        "Tear-free frames sent, refreshes waiting for the daemon, frame rate");
+    object_class_property_add_str(oc, "memory", qubes_gui_get_memory, NULL);
+    object_class_property_set_description(oc, "memory",
+        "Current/peak memory use per category, in bytes");
+    object_class_property_add(oc, "mem-limit", "uint64",
+                              qubes_gui_get_mem_limit,
+                              qubes_gui_set_mem_limit, NULL, NULL);
+    object_class_property_set_description(oc, "mem-limit",
+        "Memory the agent may allocate, 0 for no limit");
+    for (i = 0; i < ARRAY_SIZE(qubes_gui_profile_params); i++) {
+        const QubesGuiProfileParam *param = &qubes_gui_profile_params[i];
+
+        object_class_property_add(oc, param->name, "uint32",
+                                  qubes_gui_get_profile_param,
+                                  qubes_gui_set_profile_param, NULL,
+                                  (void *) param);
+        object_class_property_set_description(oc, param->name,
+                                              param->description);
+    }
+    object_class_property_add_bool(oc, "filter-spurious",
+                                   qubes_gui_get_filter_spurious,
+                                   qubes_gui_set_filter_spurious);
+    object_class_property_set_description(oc, "filter-spurious",
+        "Ignore one-line updates, which some guests send constantly");
+    object_class_property_add_bool(oc, "page-flip",
+                                   qubes_gui_get_page_flip,
+                                   qubes_gui_set_page_flip);
+    object_class_property_set_description(oc, "page-flip",
+        "Tear-free output through two granted copies of the surface");
+    object_class_property_add_bool(oc, "refine-damage",
+                                   qubes_gui_get_refine_damage,
+                                   qubes_gui_set_refine_damage);
+    object_class_property_set_description(oc, "refine-damage",
+        "Send only the screen tiles whose content changed");
+    object_class_property_add_str(oc, "damage-bytes",
+                                  qubes_gui_get_damage_bytes, NULL);
+    object_class_property_set_description(oc, "damage-bytes",
+        "Pixel data damaged by the guest and sent after refining, in bytes");
+}
+
+static const TypeInfo qubes_gui_type_info = {
+    .name = TYPE_QUBES_GUI,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(QubesGuiObject),
+    .class_init = qubes_gui_class_init,
+};
+
+static void qubes_gui_object_create(QubesGuiState *qs)
+{
+    QubesGuiObject *obj = QUBES_GUI(object_new(TYPE_QUBES_GUI));
+
+    obj->qs = qs;
+    object_property_add_child(object_get_objects_root(), TYPE_QUBES_GUI,
+                              OBJECT(obj));
+    object_unref(obj);
+}
+
+static void qubesgui_pv_display_init(DisplayState *ds, DisplayOptions *o)
+{
     QubesGuiState *qs = g_new0(QubesGuiState, 1);
+    ScreenSyncConfig config;
+
     if (!qs)
         return;
 
-    qs->init_done = 0;
+    qubesgui_state = qs;
     qs->init_state = 0;
-    qs->log_level = o->u.qubes_gui.log_level;
-
-    fprintf(stderr, "qubes_gui/init: %d\n", __LINE__);
+    qs->profile = (QubesGuiProfile) {
+        .refresh_min_ms = REFRESH_MIN_MS,
+        .refresh_max_ms = REFRESH_MAX_MS,
+        .max_pending = UPDATE_SCHED_MAX,
+        .rate_cap_hz = UPDATE_RATE_CAP_HZ,
+        .focus_ms = INPUT_FOCUS_MS,
+        .repaint_queue_max = REPAINT_QUEUE_MAX,
+        .batch_max_us = VCHAN_BATCH_MAX_US,
+        .log_level = o->u.qubes_gui.log_level,
+        .filter_spurious = true,
+        .refine_damage = QUBES_GUI_REFINE_DAMAGE,
+        .page_flip = QUBES_GUI_PAGE_FLIP,
+    };
+    qs->profile_next = qs->profile;
+    qs->log_level = qs->profile.log_level;
+    config = qubesgui_sync_config(&qs->profile);
+    screen_sync_init(&qs->sync, &config,
+                     QUBES_GUI_IOTHREAD ? &sync_io_ops : &sync_ops, qs);
+    mem_budget_set_limit(QUBES_GUI_MEM_LIMIT);
+    evlog_init(evlog_mask_for_level(qs->log_level), qs->log_level > 0);
+    evlog(EV_INIT_START);
+
+    qs->resize_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                    qubesgui_resize_timer, qs);
     qs->dcl.con = qemu_console_lookup_default();
     qs->dcl.ops = &dcl_ops;
-    fprintf(stderr, "qubes_gui/init: %d\n", __LINE__);
     // This also calls qubesgui_pv_switch() which sets the surface if
     // already available.
     register_displaychangelistener(&qs->dcl);
 
-    qs->vchan = peer_server_init(qubesgui_domid, 6000);
-    qemu_set_fd_handler(libvchan_fd_for_select(qs->vchan),
-                        qubesgui_message_handler,
-                        NULL,
-                        qs);
-    qubesgui_init_connection(qs);
+    txrx_register_queue_trace(qubesgui_queue_append, qubesgui_queue_drain);
+    txrx_set_write_batching(1, qs->profile.batch_max_us);
+    if (QUBES_GUI_IOTHREAD) {
+        qs->io = qubesgui_io_thread_start(qubesgui_domid,
+                                          qubesgui_io_thread_handler, qs);
+    } else {
+        qs->sync.vchan = peer_server_init(qubesgui_domid, 6000);
+        qemu_set_fd_handler(libvchan_fd_for_select(qs->sync.vchan),
+                            qubesgui_message_handler,
+                            NULL,
+                            qs);
+        qubesgui_init_connection(qs);
+    }
 
     qemu_add_led_event_handler(qubesgui_pv_kbd_led_event, qs);
+    qubes_gui_object_create(qs);
+}
+
+static void qubesgui_connection_ready(QubesGuiState * qs,
+                                      struct msg_xconf *xconf)
+{
+    evlog(EV_INIT_XCONF, xconf->w, xconf->h, xconf->depth, xconf->mem);
+    latency_reset_samples(qs);
+    screen_sync_connect(&qs->sync, xconf->w, xconf->h, qemu_get_vm_name());
+    // don't let the guest use a mode larger than the dom0 screen
+    if (qs->sync.has_surface)
+        qubesgui_set_ui_info(qs, qs->sync.surface.width,
+                             qs->sync.surface.height);
+    qs->init_state = 2;
 }
 
 static void qubesgui_init_connection(QubesGuiState * qs)
@@ -607,55 +1282,36 @@ static void qubesgui_init_connection(QubesGuiState * qs)
         /* -1 to distinguish between "0 bytes to discard" and "do not
          * discard this data" */
         qs->vchan_data_to_discard = -1;
-        send_protocol_version(qs);
-        fprintf(stderr,
-                "qubes_gui/init[%d]: version sent, waiting for xorg conf\n",
-                __LINE__);
-        // XXX warning - thread unsafe
+        reset_resize_state(qs);
+        qubesgui_send_protocol_version(qs->sync.vchan);
+        qubesgui_flush_vchan(qs);
+        evlog(EV_INIT_VERSION_SENT);
         qs->init_state++;
     }
     if (qs->init_state == 1) {
-        if (!libvchan_data_ready(qs->vchan))
+        if (!libvchan_data_ready(qs->sync.vchan))
             return;
 
-        read_struct(qs->vchan, xconf);
-        fprintf(stderr,
-                "qubes_gui/init[%d]: got xorg conf, creating window\n",
-                __LINE__);
-        // If we don't have a surface yet just send an arbitary window
-        // size. QEMU should set a surface very soon.
-        qubes_create_window(qs,
-                            qs->surface ? surface_width(qs->surface) : 100,
-                            qs->surface ? surface_height(qs->surface) : 100);
-
-        send_map(qs);
-        send_wmname(qs, qemu_get_vm_name());
-
-        fprintf(stderr, "qubes_gui/init: %d\n", __LINE__);
-        /* process_pv_resize will send grant refs */
-        process_pv_resize(qs);
-
-        qs->init_state++;
-        qs->init_done = 1;
+        read_struct(qs->sync.vchan, xconf);
+        qubesgui_connection_ready(qs, &xconf);
     }
 }
 
 static xengntshr_handle *xgs = NULL;
 
-uint8_t *qubesgui_alloc_surface_data(int width, int height, uint32_t **refs) {
-    size_t pages;
+static size_t surface_data_pages(int width, int height)
+{
+    return (((size_t) width * height * 4) + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+}
+
+static uint8_t *share_surface_pages(size_t pages, uint32_t **refs)
+{
     uint8_t *data;
 
     if (qubesgui_domid == ~0) {
         fprintf(stderr, "GUI domain id not set before first surface allocation!\n");
         return NULL;
     }
-   
-    pages = ((width * height * 4) + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
-
-    *refs = calloc(pages, sizeof(uint32_t));
-    if (*refs == NULL)
-        return NULL;
 
     if (xgs == NULL) {
         xgs = xengntshr_open(NULL, 0);
@@ -665,15 +1321,66 @@ uint8_t *qubesgui_alloc_surface_data(int width, int height, uint32_t **refs) {
         }
     }
 
+    *refs = calloc(pages, sizeof(uint32_t));
+    if (*refs == NULL)
+        return NULL;
+
     data = xengntshr_share_pages(xgs, qubesgui_domid, pages, *refs, 0);
     if (data == NULL) {
         fprintf(stderr, "Failes to allocate %zu grant pages!\n", pages);
+        free(*refs);
+        *refs = NULL;
+    }
+    return data;
+}
+
+/*
+ * Surfaces of the device model. QEMU frees them on its own, so they aren't
+ * accounted here; the one being displayed is, see account_surface().
+ */
+uint8_t *qubesgui_alloc_surface_data(int width, int height, uint32_t **refs) {
+    size_t pages = surface_data_pages(width, height);
+
+    // refuse modes which don't fit, rather than running out of memory; the
+    // outbound queue doesn't count, it can be dropped and resent
+    if (!mem_budget_fits_without(MEM_QUEUE, pages * XC_PAGE_SIZE)) {
+        fprintf(stderr, "Surface %dx%d exceeds the memory budget (%zu/%zu)\n",
+                width, height, mem_budget_total(), mem_budget_limit());
         return NULL;
     }
+    return share_surface_pages(pages, refs);
+}
+
+/* Granted buffers of the agent itself (page flipping), accounted until
+ * freed with qubesgui_free_buffer_data() */
+uint8_t *qubesgui_alloc_buffer_data(int width, int height, uint32_t **refs) {
+    size_t pages = surface_data_pages(width, height);
+    uint8_t *data;
 
+    if (!mem_budget_reserve(MEM_SURFACE, pages * XC_PAGE_SIZE))
+        return NULL;
+    data = share_surface_pages(pages, refs);
+    if (!data) {
+        mem_budget_release(MEM_SURFACE, pages * XC_PAGE_SIZE);
+        return NULL;
+    }
+    mem_budget_add(MEM_REFS, pages * sizeof(uint32_t));
     return data;
 }
 
+void qubesgui_free_buffer_data(uint8_t *data, int width, int height,
+                               uint32_t *refs) {
+    size_t pages;
+
+    if (!data)
+        return;
+    pages = surface_data_pages(width, height);
+    xengntshr_unshare(xgs, data, pages);
+    free(refs);
+    mem_budget_release(MEM_SURFACE, pages * XC_PAGE_SIZE);
+    mem_budget_release(MEM_REFS, pages * sizeof(uint32_t));
+}
+
 static void qubesgui_display_early_init(DisplayOptions *opts) {
     assert(opts->type == DISPLAY_TYPE_QUBES_GUI);
     qubesgui_domid = opts->u.qubes_gui.domid;
@@ -686,6 +1393,7 @@ static QemuDisplay qemu_display_qubesgui = {
 };
 
 static void register_qubesgui(void) {
+    type_register_static(&qubes_gui_type_info);
     qemu_display_register(&qemu_display_qubesgui);
 }
 
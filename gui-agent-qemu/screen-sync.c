@@ -0,0 +1,737 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * The outbound side of the agent: which damage, geometry and grant refs are
+ * sent to the daemon, and when. qubes-gui.c feeds it the guest's damage and
+ * surface switches and calls it at the end of every refresh; the queue
+ * behind the vchan may be the double buffer of the calling thread or the
+ * I/O thread's, see ScreenSyncOps.
+ *
+ * Apart from qemu/osdep.h and the trace points this depends on neither QEMU
+ * nor Xen, so that tests/test-slow-consumer.c can run it against a stand-in
+ * daemon (with the headers in tests/mock).
+ */
+
+#include "qemu/osdep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <qubes-gui-protocol.h>
+#include <xenctrl.h>
+#include "screen-sync.h"
+#include "txrx.h"
+#include "double-buffer.h"
+#include "event-log.h"
+#include "mem-budget.h"
+#include "trace.h"
+
+/* from /usr/include/X11/Xutil.h */
+#define PMinSize        (1L << 4) /* program specified minimum size */
+#define PMaxSize        (1L << 5) /* program specified maximum size */
+
+/* Abort instead of only logging when screen_sync_check_resources() finds a
+ * leak, for long runs against a slow or reconnecting daemon */
+#ifndef QUBES_GUI_CHECK_RESOURCES
+#define QUBES_GUI_CHECK_RESOURCES 0
+#endif
+
+static void sync_start_repaint(ScreenSync *ss);
+
+/* Whether the outbound queue is the double buffer of this thread */
+static bool sync_owns_queue(ScreenSync *ss)
+{
+    return !ss->ops->queued;
+}
+
+int screen_sync_queued(ScreenSync *ss)
+{
+    if (ss->ops->queued)
+        return ss->ops->queued(ss->opaque);
+    return double_buffer_datacount();
+}
+
+static unsigned long long sync_stream_end(ScreenSync *ss)
+{
+    if (ss->ops->stream_end)
+        return ss->ops->stream_end(ss->opaque);
+    return double_buffer_position();
+}
+
+static unsigned long long sync_stream_sent(ScreenSync *ss)
+{
+    if (ss->ops->stream_sent)
+        return ss->ops->stream_sent(ss->opaque);
+    return double_buffer_position() - double_buffer_datacount();
+}
+
+/* Write out everything queued, the I/O thread flushes on its own */
+static void sync_flush_vchan(ScreenSync *ss)
+{
+    if (ss->vchan)
+        write_data(ss->vchan, NULL, 0);
+}
+
+static size_t surface_nrefs(const ScreenSyncSurface *surface)
+{
+    return (((size_t) surface->width * surface->height * 4) +
+            XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+}
+
+static void process_pv_update(ScreenSync *ss, int x, int y, int width,
+                              int height)
+{
+    struct msg_shmimage mx;
+    struct msg_hdr hdr;
+
+    hdr.type = MSG_SHMIMAGE;
+    hdr.window = QUBES_MAIN_WINDOW;
+    mx.x = x;
+    mx.y = y;
+    mx.width = width;
+    mx.height = height;
+    write_message(ss->vchan, hdr, mx);
+    trace_qubesgui_process_pv_update(x, y, width, height,
+                                     screen_sync_queued(ss));
+    if (ss->ops->update_queued)
+        ss->ops->update_queued(ss->opaque);
+}
+
+static void qubes_create_window(ScreenSync *ss, int w, int h)
+{
+    struct msg_hdr hdr;
+    struct msg_create crt;
+
+    // the following hopefully avoids missed damage events
+    hdr.type = MSG_CREATE;
+    hdr.window = QUBES_MAIN_WINDOW;
+    crt.width = w;
+    crt.height = h;
+    crt.parent = 0;
+    crt.x = 0;
+    crt.y = 0;
+    crt.override_redirect = 0;
+    write_message(ss->vchan, hdr, crt);
+}
+
+/* Grant refs of the pages the daemon should read from */
+static uint32_t *shown_refs(ScreenSync *ss)
+{
+    if (page_flip_active(&ss->flip))
+        return page_flip_front_refs(&ss->flip);
+    return ss->surface.refs;
+}
+
+static void send_pixmap_grant_refs(ScreenSync *ss)
+{
+    size_t n;
+    struct msg_hdr hdr;
+    struct msg_window_dump_hdr wd_hdr;
+    char *msg;
+
+    if (shown_refs(ss) == NULL) {
+        fprintf(stderr, "Can't dump surface without grant refs allocation!\n");
+        return;
+    }
+
+    n = surface_nrefs(&ss->surface);
+
+    hdr.type = MSG_WINDOW_DUMP;
+    hdr.window = QUBES_MAIN_WINDOW;
+    hdr.untrusted_len = MSG_WINDOW_DUMP_HDR_LEN + n * SIZEOF_GRANT_REF;
+
+    wd_hdr.type = WINDOW_DUMP_TYPE_GRANT_REFS;
+    wd_hdr.width = ss->surface.width;
+    wd_hdr.height = ss->surface.height;
+    wd_hdr.bpp = 24;
+
+    // one write, so that it can't be dropped halfway, see write_data_queued()
+    msg = malloc(sizeof(hdr) + MSG_WINDOW_DUMP_HDR_LEN + n * SIZEOF_GRANT_REF);
+    if (!msg) {
+        fprintf(stderr, "malloc");
+        exit(1);
+    }
+    memcpy(msg, &hdr, sizeof(hdr));
+    memcpy(msg + sizeof(hdr), &wd_hdr, MSG_WINDOW_DUMP_HDR_LEN);
+    memcpy(msg + sizeof(hdr) + MSG_WINDOW_DUMP_HDR_LEN, shown_refs(ss),
+           n * SIZEOF_GRANT_REF);
+    write_data(ss->vchan, msg, sizeof(hdr) + MSG_WINDOW_DUMP_HDR_LEN +
+               n * SIZEOF_GRANT_REF);
+    free(msg);
+    trace_qubesgui_send_pixmap_grant_refs(wd_hdr.width, wd_hdr.height, n,
+                                          screen_sync_queued(ss));
+}
+
+static void send_wmname(ScreenSync *ss, const char *wmname)
+{
+    struct msg_hdr hdr;
+    struct msg_wmname msg;
+    strncpy(msg.data, wmname, sizeof(msg.data)-1);
+    hdr.window = QUBES_MAIN_WINDOW;
+    hdr.type = MSG_WMNAME;
+    write_message(ss->vchan, hdr, msg);
+}
+
+static void send_wmhints(ScreenSync *ss)
+{
+    struct msg_hdr hdr;
+    struct msg_window_hints msg;
+
+    // pass only some hints; a ui_info hook in the device model doesn't mean
+    // that the guest driver resizes, until it did the window keeps the
+    // surface size, or the display would be cropped
+    if (ss->ui_followed && ss->screen_width) {
+        // the guest follows the window size, see screen_sync_ui_info()
+        msg.flags = PMaxSize;
+        msg.max_width = ss->screen_width;
+        msg.max_height = ss->screen_height;
+    } else {
+        msg.flags = (PMinSize | PMaxSize);
+        msg.min_width = ss->surface.width;
+        msg.min_height = ss->surface.height;
+        msg.max_width = ss->surface.width;
+        msg.max_height = ss->surface.height;
+    }
+    hdr.window = QUBES_MAIN_WINDOW;
+    hdr.type = MSG_WINDOW_HINTS;
+    write_message(ss->vchan, hdr, msg);
+}
+
+static void send_map(ScreenSync *ss)
+{
+    struct msg_hdr hdr;
+    struct msg_map_info map_info;
+
+    map_info.override_redirect = 0;
+    map_info.transient_for = 0;
+    hdr.type = MSG_MAP;
+    hdr.window = QUBES_MAIN_WINDOW;
+    write_message(ss->vchan, hdr, map_info);
+}
+
+static void process_pv_resize(ScreenSync *ss)
+{
+    if (!ss->has_surface) {
+        return;
+    }
+
+    struct msg_hdr hdr;
+    struct msg_configure conf;
+    hdr.type = MSG_CONFIGURE;
+    hdr.window = QUBES_MAIN_WINDOW;
+    conf.x = ss->x;
+    conf.y = ss->y;
+    conf.width = ss->surface.width;
+    conf.height = ss->surface.height;
+    conf.override_redirect = 0;
+    evlog(EV_RESIZE, conf.width, conf.height);
+    write_message(ss->vchan, hdr, conf);
+    if (!ss->config.page_flip)
+        page_flip_free(&ss->flip);
+    else if (!page_flip_resize(&ss->flip, conf.width, conf.height,
+                               ss->surface.data, ss->surface.stride))
+        // the surface is shown directly instead
+        trace_qubesgui_page_flip_failed(conf.width, conf.height);
+    send_pixmap_grant_refs(ss);
+    ss->flip_mark = sync_stream_end(ss);
+    send_wmhints(ss);
+    trace_qubesgui_process_pv_resize(conf.width, conf.height,
+                                     screen_sync_queued(ss));
+}
+
+static bool resize_is_redundant(ScreenSync *ss)
+{
+    uint32_t *refs = ss->surface.refs;
+    size_t n = surface_nrefs(&ss->surface);
+
+    return refs && ss->sent_refs &&
+        ss->sent_width == ss->surface.width &&
+        ss->sent_height == ss->surface.height &&
+        ss->sent_nrefs == n &&
+        !memcmp(ss->sent_refs, refs, n * sizeof(*refs));
+}
+
+static void free_sent_refs(ScreenSync *ss)
+{
+    mem_budget_release(MEM_REFS, ss->sent_nrefs * sizeof(*ss->sent_refs));
+    free(ss->sent_refs);
+    ss->sent_refs = NULL;
+    ss->sent_nrefs = 0;
+}
+
+static void remember_sent_geometry(ScreenSync *ss)
+{
+    uint32_t *refs = ss->surface.refs;
+    size_t n = surface_nrefs(&ss->surface);
+
+    ss->sent_width = ss->surface.width;
+    ss->sent_height = ss->surface.height;
+    if (!refs) {
+        free_sent_refs(ss);
+        return;
+    }
+    if (ss->sent_nrefs != n || !ss->sent_refs) {
+        free_sent_refs(ss);
+        ss->sent_refs = malloc(n * sizeof(*refs));
+        if (!ss->sent_refs) {
+            fprintf(stderr, "malloc");
+            exit(1);
+        }
+        ss->sent_nrefs = n;
+        mem_budget_add(MEM_REFS, n * sizeof(*refs));
+    }
+    memcpy(ss->sent_refs, refs, n * sizeof(*refs));
+}
+
+void screen_sync_reset(ScreenSync *ss)
+{
+    ss->resize_pending = 0;
+    ss->updates_suppressed = 0;
+    free_sent_refs(ss);
+    ss->sent_width = 0;
+    ss->sent_height = 0;
+    ss->resize_msg_start = ss->resize_msg_end = sync_stream_end(ss);
+}
+
+/* Check that what the agent holds matches its state: grant pages for the
+ * displayed surface (and page flip buffers) only, and no outbound data outside
+ * of the memory budget. Run on every disconnect, where leaks from the resize and
+ * reconnect paths accumulate. Returns the number of problems found. */
+int screen_sync_check_resources(ScreenSync *ss)
+{
+    // surfaces QEMU allocated but doesn't display aren't accounted
+    size_t pages = ss->surface_pages, surface, refs;
+    int problems = 0;
+
+    if (page_flip_active(&ss->flip))
+        pages += 2 * (((size_t) ss->flip.width * ss->flip.height * 4 +
+                       XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT);
+    surface = mem_budget_used(MEM_SURFACE);
+    refs = mem_budget_used(MEM_REFS);
+    if (surface > pages * XC_PAGE_SIZE) {
+        fprintf(stderr, "qubes_gui: %zu grant pages leaked\n",
+                surface / XC_PAGE_SIZE - pages);
+        problems++;
+    }
+    if (refs > (pages + ss->sent_nrefs) * sizeof(uint32_t)) {
+        fprintf(stderr, "qubes_gui: %zu bytes of grant refs leaked\n",
+                refs - (pages + ss->sent_nrefs) * sizeof(uint32_t));
+        problems++;
+    }
+    // the I/O thread accounts its queue while draining it, the two can only
+    // be compared from the thread which owns the double buffer
+    if (sync_owns_queue(ss) &&
+        (size_t) screen_sync_queued(ss) > mem_budget_used(MEM_QUEUE)) {
+        fprintf(stderr, "qubes_gui: %d bytes queued outside of the budget\n",
+                screen_sync_queued(ss));
+        problems++;
+    }
+    if (problems && QUBES_GUI_CHECK_RESOURCES) {
+        fprintf(stderr, "BUG: qubes_gui: resource check failed\n");
+        exit(1);
+    }
+    return problems;
+}
+
+/* Send the resize sequence for the current surface, replacing the previous
+ * one if it is still waiting in the outbound queue with nothing behind it. */
+static void send_pv_resize(ScreenSync *ss)
+{
+    bool replaced = false;
+
+    if (!ss->has_surface)
+        return;
+
+    // the double buffer belongs to the I/O thread if there is one
+    if (sync_owns_queue(ss) && ss->resize_msg_end != ss->resize_msg_start &&
+        sync_stream_end(ss) == ss->resize_msg_end)
+        replaced = double_buffer_truncate(ss->resize_msg_start);
+
+    ss->resize_msg_start = sync_stream_end(ss);
+    process_pv_resize(ss);
+    ss->resize_msg_end = sync_stream_end(ss);
+    remember_sent_geometry(ss);
+    if (replaced)
+        trace_qubesgui_resize_replaced(ss->sent_width, ss->sent_height,
+                                       screen_sync_queued(ss));
+}
+
+/* Send the next tiles of a full repaint, as long as the daemon keeps up */
+static void sync_repaint_step(ScreenSync *ss)
+{
+    QubesGuiRect r;
+    int sent = 0;
+
+    if (!update_repaint_active(&ss->repaint) || !ss->init_done ||
+        ss->resize_pending)
+        return;
+    while (screen_sync_queued(ss) < ss->config.repaint_queue_max &&
+           update_repaint_next(&ss->repaint, &r)) {
+        process_pv_update(ss, r.x, r.y, r.w, r.h);
+        sent++;
+    }
+    trace_qubesgui_repaint_step(sent, screen_sync_queued(ss),
+                                update_repaint_active(&ss->repaint));
+}
+
+static void sync_start_repaint(ScreenSync *ss)
+{
+    // the hashes say what the daemon was sent last, which the repaint
+    // replaces; a tile changing back to that content must still be sent
+    damage_refine_reset(&ss->refine);
+    update_repaint_start(&ss->repaint, ss->surface.width,
+                         ss->surface.height);
+    sync_repaint_step(ss);
+}
+
+/* Output the daemon didn't take was dropped (see write_data_queued()), which
+ * may have been a geometry message as well as screen updates. Once it caught
+ * up, send the window geometry and grant refs again and repaint. */
+static void sync_resync_dropped(ScreenSync *ss)
+{
+    unsigned long long dropped = txrx_get_dropped();
+
+    if (dropped == ss->dropped_seen || !ss->init_done || ss->resize_pending ||
+        !ss->has_surface || screen_sync_queued(ss))
+        return;
+    trace_qubesgui_resync_dropped(dropped - ss->dropped_seen);
+    ss->dropped_seen = dropped;
+    free_sent_refs(ss);
+    send_pv_resize(ss);
+    sync_start_repaint(ss);
+}
+
+static void flush_pv_resize(ScreenSync *ss)
+{
+    ss->resize_pending = 0;
+    if (!ss->has_surface)
+        return;
+
+    if (resize_is_redundant(ss))
+        trace_qubesgui_resize_skipped(ss->sent_width, ss->sent_height);
+    else
+        send_pv_resize(ss);
+
+    /* damage reported while the resize was settling was dropped, and a
+     * repaint in progress has the old geometry */
+    if (ss->updates_suppressed || update_repaint_active(&ss->repaint)) {
+        ss->updates_suppressed = 0;
+        sync_start_repaint(ss);
+    }
+}
+
+void screen_sync_flush_resize(ScreenSync *ss)
+{
+    if (ss->init_done && ss->resize_pending) {
+        flush_pv_resize(ss);
+        sync_flush_vchan(ss);
+    }
+}
+
+bool screen_sync_ui_info(ScreenSync *ss, int *width, int *height)
+{
+    if (ss->screen_width && *width > ss->screen_width)
+        *width = ss->screen_width;
+    if (ss->screen_height && *height > ss->screen_height)
+        *height = ss->screen_height;
+    if (*width <= 0 || *height <= 0)
+        return false;
+    if (*width == ss->ui_width && *height == ss->ui_height)
+        return false;
+
+    ss->ui_width = *width;
+    ss->ui_height = *height;
+    // only a switch the guest wouldn't have done anyway counts
+    ss->ui_pending = !ss->has_surface || *width != ss->surface.width ||
+        *height != ss->surface.height;
+    trace_qubesgui_set_ui_info(*width, *height);
+    return true;
+}
+
+void screen_sync_update(ScreenSync *ss, int x, int y, int w, int h)
+{
+    if (!ss->init_done)
+        return;
+    // the daemon still has the old geometry, repaint once it is updated
+    if (ss->resize_pending) {
+        ss->updates_suppressed = 1;
+        return;
+    }
+    // ignore one-line updates, Windows send them constantly at no reason
+    if (h == 1 && ss->config.filter_spurious) {
+        trace_qubesgui_pv_update_filtered(x, y, w, h);
+        return;
+    }
+    // only damage which is going to be sent counts
+    if (ss->ops->damage)
+        ss->ops->damage(ss->opaque);
+    trace_qubesgui_pv_update(x, y, w, h);
+    ss->refresh_active = true;
+    // short of memory, let updates coalesce instead of queueing them; with
+    // page flipping or refining everything waits for the end of the frame
+    if (ss->sched.batching || mem_budget_pressure() ||
+        page_flip_active(&ss->flip) || ss->config.refine_damage) {
+        update_sched_add(&ss->sched, x, y, w, h);
+    } else {
+        process_pv_update(ss, x, y, w, h);
+        sync_flush_vchan(ss);
+    }
+}
+
+/* QEMU allocates and frees surfaces without telling the agent, only the one
+ * being displayed is accounted in the memory budget. */
+static void account_surface(ScreenSync *ss, const ScreenSyncSurface *surface)
+{
+    size_t pages = 0;
+
+    if (surface && surface->refs)
+        pages = surface_nrefs(surface);
+    mem_budget_release(MEM_SURFACE, ss->surface_pages * XC_PAGE_SIZE);
+    mem_budget_release(MEM_REFS, ss->surface_pages * sizeof(uint32_t));
+    mem_budget_add(MEM_SURFACE, pages * XC_PAGE_SIZE);
+    mem_budget_add(MEM_REFS, pages * sizeof(uint32_t));
+    ss->surface_pages = pages;
+}
+
+int64_t screen_sync_switch(ScreenSync *ss, const ScreenSyncSurface *surface,
+                           int64_t now_ms)
+{
+    int64_t deadline;
+
+    account_surface(ss, surface);
+    ss->has_surface = surface != NULL;
+    if (!surface) {
+        memset(&ss->surface, 0, sizeof(ss->surface));
+        return 0;
+    }
+    ss->surface = *surface;
+    // the resize sequence sent for this switch carries the relaxed hints
+    if (ss->ui_pending && surface->width == ss->ui_width &&
+        surface->height == ss->ui_height) {
+        ss->ui_pending = false;
+        ss->ui_followed = true;
+    }
+    update_sched_resize(&ss->sched, surface->width, surface->height);
+    damage_refine_resize(&ss->refine, surface->width, surface->height);
+    // reallocated, dropped again if still short of memory
+    ss->sched_state_dropped = false;
+    if (!surface->refs)
+        trace_qubesgui_surface_not_granted(surface->width, surface->height,
+                                           surface->stride);
+
+    if (!ss->init_done)
+        return 0;
+
+    // Guests tend to switch modes several times in a row (boot, driver
+    // installation), let it settle before telling the daemon.
+    if (!ss->resize_pending) {
+        ss->resize_pending = 1;
+        ss->resize_pending_since = now_ms;
+    }
+    trace_qubesgui_resize_deferred(surface->width, surface->height);
+    deadline = now_ms + RESIZE_SETTLE_MS;
+    if (deadline > ss->resize_pending_since + RESIZE_SETTLE_MAX_MS)
+        deadline = ss->resize_pending_since + RESIZE_SETTLE_MAX_MS;
+    return deadline;
+}
+
+/* The daemon copies from the buffer named by the last dump until it has read
+ * the updates after it, so the back buffer can't be rewritten before that. */
+static bool sync_flip_ready(ScreenSync *ss)
+{
+    return sync_stream_sent(ss) >= ss->flip_mark;
+}
+
+/* Rate limiting and refining are optional, under memory pressure their tile
+ * state goes first; it is rebuilt once the daemon caught up. */
+static void sync_sched_state(ScreenSync *ss)
+{
+    if (mem_budget_pressure()) {
+        if (ss->sched_state_dropped)
+            return;
+        ss->sched_state_dropped = true;
+        trace_qubesgui_sched_state(0, mem_budget_used(MEM_SCHED));
+        update_sched_release(&ss->sched);
+        damage_refine_release(&ss->refine);
+    } else if (ss->sched_state_dropped && !screen_sync_queued(ss)) {
+        ss->sched_state_dropped = false;
+        update_sched_resize(&ss->sched, ss->surface.width,
+                            ss->surface.height);
+        damage_refine_resize(&ss->refine, ss->surface.width,
+                             ss->surface.height);
+        trace_qubesgui_sched_state(1, mem_budget_used(MEM_SCHED));
+    }
+}
+
+/* Send the damage collected during this refresh, regions near the pointer
+ * first if the user is interacting with the VM. */
+static void sync_flush_updates(ScreenSync *ss, int64_t now_ms, bool focus,
+                               int x, int y)
+{
+    UpdateRateLimit *rl = &ss->sched.rate;
+    int i;
+
+    if (!ss->init_done || ss->resize_pending) {
+        // the surface was switched during the refresh
+        if (ss->sched.npending)
+            ss->updates_suppressed = ss->init_done;
+        update_sched_clear(&ss->sched);
+        return;
+    }
+    sync_sched_state(ss);
+    // keep collecting (and merging) damage until the daemon catches up
+    if (mem_budget_pressure() && screen_sync_queued(ss)) {
+        trace_qubesgui_updates_deferred(ss->sched.npending,
+                                        screen_sync_queued(ss));
+        return;
+    }
+    // the damage keeps merging in the scheduler, and goes out with one flip
+    if (page_flip_active(&ss->flip) && ss->sched.npending &&
+        !sync_flip_ready(ss)) {
+        ss->flip_deferred++;
+        ss->refresh_active = true;
+        trace_qubesgui_page_flip_deferred(ss->sched.npending,
+                                          screen_sync_queued(ss));
+        return;
+    }
+    update_sched_rate_limit(&ss->sched, now_ms);
+    if (rl->hot_tiles)
+        trace_qubesgui_rate_limit(rl->hot_tiles, rl->held, rl->paced);
+    if (ss->config.refine_damage && ss->sched.npending) {
+        damage_refine(&ss->refine, &ss->sched, ss->surface.data,
+                      ss->surface.stride);
+        trace_qubesgui_damage_refine(ss->sched.npending, ss->refine.reported,
+                                     ss->refine.refined);
+    }
+    if (!ss->sched.npending)
+        return;
+    if (focus)
+        update_sched_order_by_focus(&ss->sched, x, y);
+    trace_qubesgui_flush_updates(ss->sched.npending, focus, x, y);
+    if (page_flip_active(&ss->flip)) {
+        page_flip_frame(&ss->flip, ss->surface.data, ss->surface.stride,
+                        ss->sched.pending, ss->sched.npending);
+        send_pixmap_grant_refs(ss);
+    }
+    for (i = 0; i < ss->sched.npending; i++) {
+        QubesGuiRect *r = &ss->sched.pending[i];
+        process_pv_update(ss, r->x, r->y, r->w, r->h);
+    }
+    if (page_flip_active(&ss->flip)) {
+        ss->flip_mark = sync_stream_end(ss);
+        ss->flip_frames++;
+    }
+    update_sched_clear(&ss->sched);
+}
+
+void screen_sync_refresh(ScreenSync *ss, int64_t now_ms, bool focus,
+                         int x, int y)
+{
+    sync_flush_updates(ss, now_ms, focus, x, y);
+    sync_resync_dropped(ss);
+    sync_repaint_step(ss);
+    sync_flush_vchan(ss);
+}
+
+void screen_sync_init(ScreenSync *ss, const ScreenSyncConfig *config,
+                      const ScreenSyncOps *ops, void *opaque)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->ops = ops;
+    ss->opaque = opaque;
+    ss->config = *config;
+    ss->sched.max_pending = config->max_pending;
+    ss->sched.rate.cap_hz = config->rate_cap_hz;
+    update_repaint_stop(&ss->repaint);
+}
+
+void screen_sync_configure(ScreenSync *ss, const ScreenSyncConfig *config)
+{
+    bool flip_changed = ss->config.page_flip != config->page_flip;
+    bool refine_enabled = !ss->config.refine_damage && config->refine_damage;
+
+    ss->config = *config;
+    ss->sched.max_pending = config->max_pending;
+    ss->sched.rate.cap_hz = config->rate_cap_hz;
+    // damage sent meanwhile didn't update the hashes
+    if (refine_enabled)
+        damage_refine_reset(&ss->refine);
+    // the resize sequence (re)allocates or frees the flip buffers and tells
+    // the daemon which pages to read from; forget what was sent so that a
+    // pending one isn't skipped as redundant
+    if (flip_changed) {
+        free_sent_refs(ss);
+        if (ss->init_done && !ss->resize_pending)
+            send_pv_resize(ss);
+    }
+}
+
+void screen_sync_connect(ScreenSync *ss, int screen_width, int screen_height,
+                         const char *name)
+{
+    ss->screen_width = screen_width;
+    ss->screen_height = screen_height;
+    ss->dropped_seen = txrx_get_dropped();
+    ss->ui_width = ss->ui_height = 0;
+    ss->ui_pending = false;
+    // If we don't have a surface yet just send an arbitary window
+    // size. QEMU should set a surface very soon.
+    qubes_create_window(ss, ss->has_surface ? ss->surface.width : 100,
+                        ss->has_surface ? ss->surface.height : 100);
+
+    send_map(ss);
+    send_wmname(ss, name);
+
+    /* send_pv_resize will send grant refs */
+    send_pv_resize(ss);
+    evlog(EV_INIT_DONE, ss->sent_width, ss->sent_height);
+
+    ss->init_done = 1;
+    // the daemon has nothing to show until the guest happens to redraw
+    if (ss->has_surface)
+        sync_start_repaint(ss);
+    else
+        update_repaint_stop(&ss->repaint);
+    sync_flush_vchan(ss);
+}
+
+static void evlog_rate_stats(ScreenSync *ss)
+{
+    UpdateRateLimit *rl = &ss->sched.rate;
+
+    evlog(EV_RATE_STATS, rl->hot_tiles, rl->held, rl->paced,
+          rl->held - rl->paced);
+}
+
+int screen_sync_disconnect(ScreenSync *ss)
+{
+    ss->init_done = 0;
+    if (ss->vchan) {
+        libvchan_close(ss->vchan);
+        /* FIXME: 0 here is hardcoded remote domain */
+        ss->vchan = peer_server_init(0, 6000);
+        fprintf(stderr,
+                "qubes_gui: viewer disconnected, waiting for new connection\n");
+    }
+    evlog(EV_DISCONNECT);
+    evlog_rate_stats(ss);
+    return screen_sync_check_resources(ss);
+}
@@ -0,0 +1 @@
+#include "trace-qubes_gui.h"
@@ -0,0 +1,438 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Damage reported by the guest during one refresh is collected here and
+ * sent in one go at the end of the refresh. When the user recently
+ * interacted with the VM, regions closest to the pointer go first, so the
+ * echo of a keystroke or click doesn't queue behind a full-screen repaint.
+ *
+ * Everything collected is sent at the end of the same refresh, so no region
+ * can starve; the order only decides what reaches the daemon first.
+ * Regions at the same distance keep the order the guest reported them in.
+ *
+ * The scheduler also keeps a short-term update frequency per tile. Regions
+ * made only of tiles updated faster than cap_hz ("hot", typically video) are
+ * held back and sent for the whole tile at cap_hz instead. The daemon copies
+ * the current content when it gets MSG_SHMIMAGE, so the paced update always
+ * shows the latest frame.
+ *
+ * A full repaint (first frame after connecting, or after a resize swallowed
+ * the damage) is handed out tile by tile, from the center outward, so the
+ * caller can pace it and the middle of the screen shows up first.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "update-sched.h"
+#include "mem-budget.h"
+
+/* intervals above this don't make a tile any colder */
+#define UPDATE_INTERVAL_MAX_MS 1000
+
+static int64_t rect_area(const QubesGuiRect *r)
+{
+    return (int64_t) r->w * r->h;
+}
+
+static QubesGuiRect rect_union(const QubesGuiRect *a, const QubesGuiRect *b)
+{
+    QubesGuiRect u;
+    int x2 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+    int y2 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+
+    u.x = a->x < b->x ? a->x : b->x;
+    u.y = a->y < b->y ? a->y : b->y;
+    u.w = x2 - u.x;
+    u.h = y2 - u.y;
+    return u;
+}
+
+static bool rect_contains(const QubesGuiRect *outer, const QubesGuiRect *r)
+{
+    return r->x >= outer->x && r->y >= outer->y &&
+        r->x + r->w <= outer->x + outer->w &&
+        r->y + r->h <= outer->y + outer->h;
+}
+
+void update_sched_add(UpdateSched *s, int x, int y, int w, int h)
+{
+    QubesGuiRect r = { x, y, w, h };
+    int64_t best_growth = INT64_MAX;
+    int max = s->max_pending ? s->max_pending : UPDATE_SCHED_MAX;
+    int i, n, best = 0;
+
+    for (i = 0; i < s->npending; i++) {
+        if (rect_contains(&s->pending[i], &r))
+            return;
+    }
+    /* drop every region the new one covers */
+    for (i = 0, n = 0; i < s->npending; i++) {
+        if (!rect_contains(&r, &s->pending[i]))
+            s->pending[n++] = s->pending[i];
+    }
+    s->npending = n;
+    if (s->npending < max) {
+        s->pending[s->npending++] = r;
+        return;
+    }
+    /* full, merge with the region growing the least */
+    for (i = 0; i < s->npending; i++) {
+        QubesGuiRect u = rect_union(&s->pending[i], &r);
+        int64_t growth = rect_area(&u) - rect_area(&s->pending[i]);
+
+        if (growth < best_growth) {
+            best_growth = growth;
+            best = i;
+        }
+    }
+    s->pending[best] = rect_union(&s->pending[best], &r);
+}
+
+/* squared distance from the point to the nearest pixel of the region */
+static int64_t rect_distance(const QubesGuiRect *r, int px, int py)
+{
+    int64_t dx = 0, dy = 0;
+
+    if (px < r->x)
+        dx = r->x - px;
+    else if (px >= r->x + r->w)
+        dx = px - (r->x + r->w - 1);
+    if (py < r->y)
+        dy = r->y - py;
+    else if (py >= r->y + r->h)
+        dy = py - (r->y + r->h - 1);
+    return dx * dx + dy * dy;
+}
+
+void update_sched_order_by_focus(UpdateSched *s, int focus_x, int focus_y)
+{
+    int64_t dist[UPDATE_SCHED_MAX];
+    int i, j;
+
+    for (i = 0; i < s->npending; i++)
+        dist[i] = rect_distance(&s->pending[i], focus_x, focus_y);
+
+    /* stable insertion sort, the list is short */
+    for (i = 1; i < s->npending; i++) {
+        QubesGuiRect r = s->pending[i];
+        int64_t d = dist[i];
+
+        for (j = i; j > 0 && dist[j - 1] > d; j--) {
+            s->pending[j] = s->pending[j - 1];
+            dist[j] = dist[j - 1];
+        }
+        s->pending[j] = r;
+        dist[j] = d;
+    }
+}
+
+void update_sched_clear(UpdateSched *s)
+{
+    s->npending = 0;
+}
+
+void update_sched_resize(UpdateSched *s, int width, int height)
+{
+    UpdateRateLimit *rl = &s->rate;
+    int cols = (width + UPDATE_TILE_SIZE - 1) / UPDATE_TILE_SIZE;
+    int rows = (height + UPDATE_TILE_SIZE - 1) / UPDATE_TILE_SIZE;
+    int i;
+
+    rl->width = width;
+    rl->height = height;
+    if (cols != rl->cols || rows != rl->rows || !rl->tiles) {
+        size_t size = (size_t) cols * rows * sizeof(*rl->tiles);
+
+        free(rl->tiles);
+        mem_budget_release(MEM_SCHED, rl->tiles_size);
+        rl->tiles = NULL;
+        rl->tiles_size = 0;
+        // without tile state there is just no rate limiting
+        if (size && mem_budget_reserve(MEM_SCHED, size)) {
+            rl->tiles = calloc(1, size);
+            if (rl->tiles)
+                rl->tiles_size = size;
+            else
+                mem_budget_release(MEM_SCHED, size);
+        }
+        rl->cols = rl->tiles ? cols : 0;
+        rl->rows = rl->tiles ? rows : 0;
+    }
+    for (i = 0; i < rl->cols * rl->rows; i++) {
+        rl->tiles[i].last_damage_ms = 0;
+        rl->tiles[i].last_sent_ms = 0;
+        rl->tiles[i].avg_interval_ms = UPDATE_INTERVAL_MAX_MS;
+        rl->tiles[i].held = 0;
+    }
+}
+
+/* Free the tile state, which turns rate limiting off until the next
+ * update_sched_resize(). Damage held back is added to the pending regions. */
+void update_sched_release(UpdateSched *s)
+{
+    UpdateRateLimit *rl = &s->rate;
+    int col, row, x, y, w, h;
+
+    for (row = 0; row < rl->rows; row++) {
+        for (col = 0; col < rl->cols; col++) {
+            if (!rl->tiles[row * rl->cols + col].held)
+                continue;
+            x = col * UPDATE_TILE_SIZE;
+            y = row * UPDATE_TILE_SIZE;
+            w = rl->width - x < UPDATE_TILE_SIZE ? rl->width - x
+                                                 : UPDATE_TILE_SIZE;
+            h = rl->height - y < UPDATE_TILE_SIZE ? rl->height - y
+                                                  : UPDATE_TILE_SIZE;
+            update_sched_add(s, x, y, w, h);
+        }
+    }
+    free(rl->tiles);
+    mem_budget_release(MEM_SCHED, rl->tiles_size);
+    rl->tiles = NULL;
+    rl->tiles_size = 0;
+    rl->cols = rl->rows = 0;
+}
+
+/* Range of tiles covered by r, clipped to the grid. Returns false if none. */
+static bool rect_tiles(const UpdateRateLimit *rl, const QubesGuiRect *r,
+                       int *c0, int *r0, int *c1, int *r1)
+{
+    *c0 = r->x / UPDATE_TILE_SIZE;
+    *r0 = r->y / UPDATE_TILE_SIZE;
+    *c1 = (r->x + r->w - 1) / UPDATE_TILE_SIZE;
+    *r1 = (r->y + r->h - 1) / UPDATE_TILE_SIZE;
+    if (*c0 < 0)
+        *c0 = 0;
+    if (*r0 < 0)
+        *r0 = 0;
+    if (*c1 >= rl->cols)
+        *c1 = rl->cols - 1;
+    if (*r1 >= rl->rows)
+        *r1 = rl->rows - 1;
+    return r->w > 0 && r->h > 0 && *c0 <= *c1 && *r0 <= *r1;
+}
+
+/* Whether r covers the whole tile, i.e. sends anything held back for it */
+static bool rect_covers_tile(const UpdateRateLimit *rl, const QubesGuiRect *r,
+                             int col, int row)
+{
+    QubesGuiRect t = { col * UPDATE_TILE_SIZE, row * UPDATE_TILE_SIZE,
+                       UPDATE_TILE_SIZE, UPDATE_TILE_SIZE };
+
+    if (t.x + t.w > rl->width)
+        t.w = rl->width - t.x;
+    if (t.y + t.h > rl->height)
+        t.h = rl->height - t.y;
+    return rect_contains(r, &t);
+}
+
+static void tile_damaged(UpdateTile *t, uint32_t now_ms)
+{
+    uint32_t interval = now_ms - t->last_damage_ms;
+
+    if (interval == 0)
+        return; /* already counted in this refresh */
+    if (interval > UPDATE_INTERVAL_MAX_MS)
+        interval = UPDATE_INTERVAL_MAX_MS;
+    t->avg_interval_ms = (t->avg_interval_ms * 7 + interval) / 8;
+    t->last_damage_ms = now_ms;
+}
+
+static void update_sched_add_paced(UpdateSched *s, uint32_t now_ms,
+                                   uint32_t min_interval)
+{
+    UpdateRateLimit *rl = &s->rate;
+    int col, row, start;
+
+    for (row = 0; row < rl->rows; row++) {
+        start = -1;
+        for (col = 0; col <= rl->cols; col++) {
+            UpdateTile *t = col < rl->cols ? &rl->tiles[row * rl->cols + col]
+                                           : NULL;
+            bool due = t && t->held &&
+                now_ms - t->last_sent_ms >= min_interval;
+
+            if (due) {
+                t->held = 0;
+                t->last_sent_ms = now_ms;
+                if (start < 0)
+                    start = col;
+                continue;
+            }
+            if (start >= 0) {
+                /* one region per run of due tiles */
+                int x = start * UPDATE_TILE_SIZE;
+                int y = row * UPDATE_TILE_SIZE;
+                int x2 = col * UPDATE_TILE_SIZE;
+                int y2 = y + UPDATE_TILE_SIZE;
+
+                if (x2 > rl->width)
+                    x2 = rl->width;
+                if (y2 > rl->height)
+                    y2 = rl->height;
+                update_sched_add(s, x, y, x2 - x, y2 - y);
+                rl->paced++;
+                start = -1;
+            }
+        }
+    }
+}
+
+/* Hold back pending regions consisting only of hot tiles and add paced
+ * updates for held back tiles which are due. Called once per refresh. */
+void update_sched_rate_limit(UpdateSched *s, uint32_t now_ms)
+{
+    UpdateRateLimit *rl = &s->rate;
+    uint32_t min_interval;
+    int i, n, col, row, c0, r0, c1, r1;
+
+    if (!rl->cap_hz || !rl->tiles)
+        return;
+    min_interval = 1000 / rl->cap_hz;
+
+    for (i = 0; i < s->npending; i++) {
+        if (!rect_tiles(rl, &s->pending[i], &c0, &r0, &c1, &r1))
+            continue;
+        for (row = r0; row <= r1; row++)
+            for (col = c0; col <= c1; col++)
+                tile_damaged(&rl->tiles[row * rl->cols + col], now_ms);
+    }
+
+    for (i = 0, n = 0; i < s->npending; i++) {
+        bool hot = true, due = true;
+
+        if (rect_tiles(rl, &s->pending[i], &c0, &r0, &c1, &r1)) {
+            for (row = r0; row <= r1; row++) {
+                for (col = c0; col <= c1; col++) {
+                    UpdateTile *t = &rl->tiles[row * rl->cols + col];
+
+                    hot &= t->avg_interval_ms < min_interval;
+                    due &= now_ms - t->last_sent_ms >= min_interval;
+                }
+            }
+            for (row = r0; row <= r1; row++) {
+                for (col = c0; col <= c1; col++) {
+                    UpdateTile *t = &rl->tiles[row * rl->cols + col];
+
+                    if (hot && !due) {
+                        t->held = 1;
+                    } else {
+                        // damage held back elsewhere in the tile still
+                        // waits for the paced update
+                        if (rect_covers_tile(rl, &s->pending[i], col, row))
+                            t->held = 0;
+                        t->last_sent_ms = now_ms;
+                    }
+                }
+            }
+            if (hot && !due) {
+                rl->held++;
+                continue;
+            }
+        }
+        s->pending[n++] = s->pending[i];
+    }
+    s->npending = n;
+
+    update_sched_add_paced(s, now_ms, min_interval);
+
+    rl->hot_tiles = 0;
+    for (i = 0; i < rl->cols * rl->rows; i++)
+        if (rl->tiles[i].avg_interval_ms < min_interval)
+            rl->hot_tiles++;
+}
+
+static int max_int(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+void update_repaint_start(UpdateRepaint *p, int width, int height)
+{
+    p->width = width;
+    p->height = height;
+    p->cols = (width + UPDATE_REPAINT_TILE_SIZE - 1) / UPDATE_REPAINT_TILE_SIZE;
+    p->rows = (height + UPDATE_REPAINT_TILE_SIZE - 1) / UPDATE_REPAINT_TILE_SIZE;
+    p->cx = width / 2 / UPDATE_REPAINT_TILE_SIZE;
+    p->cy = height / 2 / UPDATE_REPAINT_TILE_SIZE;
+    p->max_ring = max_int(max_int(p->cx, p->cols - 1 - p->cx),
+                          max_int(p->cy, p->rows - 1 - p->cy));
+    p->ring = p->cols && p->rows ? 0 : -1;
+    p->index = 0;
+}
+
+void update_repaint_stop(UpdateRepaint *p)
+{
+    p->ring = -1;
+}
+
+bool update_repaint_active(const UpdateRepaint *p)
+{
+    return p->ring >= 0;
+}
+
+/* Next tile of the repaint, false when it's complete. Ring r consists of the
+ * 8r tiles at Chebyshev distance r from the center tile, walked clockwise
+ * from the top left corner; tiles outside the surface are skipped. */
+bool update_repaint_next(UpdateRepaint *p, QubesGuiRect *r)
+{
+    while (p->ring >= 0 && p->ring <= p->max_ring) {
+        int n = p->ring ? 8 * p->ring : 1;
+        int k = p->ring, i = p->index, dx, dy, col, row;
+
+        if (i >= n) {
+            p->ring++;
+            p->index = 0;
+            continue;
+        }
+        p->index++;
+        if (!k) {
+            dx = dy = 0;
+        } else if (i < 2 * k) {
+            dx = -k + i;
+            dy = -k;
+        } else if (i < 4 * k) {
+            dx = k;
+            dy = -k + (i - 2 * k);
+        } else if (i < 6 * k) {
+            dx = k - (i - 4 * k);
+            dy = k;
+        } else {
+            dx = -k;
+            dy = k - (i - 6 * k);
+        }
+        col = p->cx + dx;
+        row = p->cy + dy;
+        if (col < 0 || row < 0 || col >= p->cols || row >= p->rows)
+            continue;
+        r->x = col * UPDATE_REPAINT_TILE_SIZE;
+        r->y = row * UPDATE_REPAINT_TILE_SIZE;
+        r->w = UPDATE_REPAINT_TILE_SIZE;
+        r->h = UPDATE_REPAINT_TILE_SIZE;
+        if (r->x + r->w > p->width)
+            r->w = p->width - r->x;
+        if (r->y + r->h > p->height)
+            r->h = p->height - r->y;
+        return true;
+    }
+    p->ring = -1;
+    return false;
+}
@@ -24,39 +24,55 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "double-buffer.h"
+#include "mem-budget.h"
 
 static char *buffer;
 static int buffer_size;
 static int data_offset;
 static int data_count;
+static unsigned long long total_appended;
+static struct double_buffer_stats stats;
 #define BUFFER_SIZE_MIN 8192
 #define BUFFER_SIZE_MAX 10000000
+// Called again on every reconnect; whatever is still queued was meant for the
+// previous peer.
 void double_buffer_init(void)
 {
+    if (buffer) {
+        free(buffer);
+        mem_budget_release(MEM_QUEUE, buffer_size);
+    }
+    data_offset = 0;
+    data_count = 0;
     buffer = malloc(BUFFER_SIZE_MIN);
     if (!buffer) {
         fprintf(stderr, "malloc");
         exit(1);
     }
     buffer_size = BUFFER_SIZE_MIN;
+    mem_budget_add(MEM_QUEUE, buffer_size);
+    stats.allocations++;
+    if (buffer_size > stats.peak_size)
+        stats.peak_size = buffer_size;
 }
 // We assume that the only common case when we need to enlarge the buffer
 // is when we send a single large blob (after Ctrl-Shift-V).
 // Thus, we optimize for double_buffer_substract(), as it can be called
 // many times; malloc(newsize) in double_buffer_append() should be rare
 // in normal circumstances.
+// Returns 0 (and queues nothing) if the buffer can't grow enough, either
+// because of BUFFER_SIZE_MAX or the memory budget (counted in
+// stats.refused); the caller decides whether to wait for the peer or drop it.
 
-void double_buffer_append(char *buf, int size)
+int double_buffer_append(char *buf, int size)
 {
     if (size + data_offset + data_count > buffer_size) {
         int newsize = data_count + size + BUFFER_SIZE_MIN;
         char *newbuf;
-        if (newsize > BUFFER_SIZE_MAX) {
-            fprintf(stderr,
-                    "double_buffer_append failed: "
-                    "offset=%d, data_count=%d, req_size=%d\n",
-                    data_offset, data_count, size);
-            exit(1);
+        if (newsize > BUFFER_SIZE_MAX ||
+            !mem_budget_reserve(MEM_QUEUE, newsize)) {
+            stats.refused++;
+            return 0;
         }
         newbuf = malloc(newsize);
         if (!newbuf) {
@@ -65,12 +81,46 @@ void double_buffer_append(char *buf, int size)
         }
         memcpy(newbuf, buffer + data_offset, data_count);
         free(buffer);
+        mem_budget_release(MEM_QUEUE, buffer_size);
         buffer = newbuf;
         buffer_size = newsize;
         data_offset = 0;
+        stats.allocations++;
+        stats.copied += data_count;
+        if (buffer_size > stats.peak_size)
+            stats.peak_size = buffer_size;
     }
     memcpy(buffer + data_offset + data_count, buf, size);
     data_count += size;
+    total_appended += size;
+    if (data_count > stats.peak_data)
+        stats.peak_data = data_count;
+    return 1;
+}
+
+// Position of the end of the queued data in the outbound stream, i.e. the
+// number of bytes ever appended. Together with double_buffer_truncate() this
+// allows dropping a message which was queued but not sent yet.
+unsigned long long double_buffer_position(void)
+{
+    return total_appended;
+}
+
+void double_buffer_get_stats(struct double_buffer_stats *out)
+{
+    *out = stats;
+    out->appended = total_appended;
+}
+
+// Drop queued data appended at or after stream position pos. Fails (returns
+// 0) if any byte of it was already handed over to the peer.
+int double_buffer_truncate(unsigned long long pos)
+{
+    if (pos > total_appended || pos < total_appended - data_count)
+        return 0;
+    data_count -= total_appended - pos;
+    total_appended = pos;
+    return 1;
 }
 
 int double_buffer_datacount(void)
@@ -96,12 +146,13 @@ void double_buffer_substract(int count)
     if (data_count == 0) {
         if (buffer_size > BUFFER_SIZE_MIN) {
             free(buffer);
+            mem_budget_release(MEM_QUEUE, buffer_size - BUFFER_SIZE_MIN);
             buffer = malloc(BUFFER_SIZE_MIN);
             if (!buffer) {
                 fprintf(stderr, "malloc");
                 exit(1);
             }
-
+            stats.allocations++;
         }
         data_offset = 0;
         buffer_size = BUFFER_SIZE_MIN;
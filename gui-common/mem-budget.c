@@ -0,0 +1,151 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Accounting of the memory the agent allocates. The stubdom has little RAM,
+ * so instead of growing until malloc fails, allocations which can be refused
+ * (display surfaces, outbound buffer growth, caches) are checked against a
+ * limit and callers degrade instead: output the outbound buffer can't take
+ * is dropped and resent later, a too large mode is refused, the update
+ * scheduler gives up its tile state under pressure.
+ *
+ * Counters are updated from both the main loop and the I/O thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mem-budget.h"
+
+static size_t used[MEM_CATEGORIES];
+static size_t peak[MEM_CATEGORIES];
+static size_t total;
+static size_t limit;
+
+static const char *category_names[MEM_CATEGORIES] = {
+    [MEM_QUEUE] = "queue",
+    [MEM_SURFACE] = "surface",
+    [MEM_REFS] = "refs",
+    [MEM_SCHED] = "sched",
+};
+
+void mem_budget_set_limit(size_t new_limit)
+{
+    __atomic_store_n(&limit, new_limit, __ATOMIC_RELAXED);
+}
+
+size_t mem_budget_limit(void)
+{
+    return __atomic_load_n(&limit, __ATOMIC_RELAXED);
+}
+
+static void update_peak(enum mem_category cat, size_t now)
+{
+    size_t old = __atomic_load_n(&peak[cat], __ATOMIC_RELAXED);
+
+    while (now > old &&
+           !__atomic_compare_exchange_n(&peak[cat], &old, now, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void mem_budget_add(enum mem_category cat, size_t size)
+{
+    __atomic_add_fetch(&total, size, __ATOMIC_RELAXED);
+    update_peak(cat, __atomic_add_fetch(&used[cat], size, __ATOMIC_RELAXED));
+}
+
+int mem_budget_reserve(enum mem_category cat, size_t size)
+{
+    size_t max = mem_budget_limit();
+    size_t old = __atomic_load_n(&total, __ATOMIC_RELAXED);
+
+    do {
+        if (max && (size > max || old > max - size))
+            return 0;
+    } while (!__atomic_compare_exchange_n(&total, &old, old + size, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    update_peak(cat, __atomic_add_fetch(&used[cat], size, __ATOMIC_RELAXED));
+    return 1;
+}
+
+void mem_budget_release(enum mem_category cat, size_t size)
+{
+    __atomic_sub_fetch(&used[cat], size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&total, size, __ATOMIC_RELAXED);
+}
+
+size_t mem_budget_used(enum mem_category cat)
+{
+    return __atomic_load_n(&used[cat], __ATOMIC_RELAXED);
+}
+
+size_t mem_budget_peak(enum mem_category cat)
+{
+    return __atomic_load_n(&peak[cat], __ATOMIC_RELAXED);
+}
+
+size_t mem_budget_total(void)
+{
+    return __atomic_load_n(&total, __ATOMIC_RELAXED);
+}
+
+int mem_budget_fits(size_t size)
+{
+    size_t max = mem_budget_limit();
+
+    return !max || (size <= max && mem_budget_total() <= max - size);
+}
+
+/* Like mem_budget_fits(), not counting what cat holds, for allocations which
+ * can't be refused gracefully while cat can be dropped instead */
+int mem_budget_fits_without(enum mem_category cat, size_t size)
+{
+    size_t max = mem_budget_limit();
+    size_t reclaimable = mem_budget_used(cat);
+    size_t total = mem_budget_total();
+    size_t others = total > reclaimable ? total - reclaimable : 0;
+
+    return !max || (size <= max && others <= max - size);
+}
+
+int mem_budget_pressure(void)
+{
+    size_t max = mem_budget_limit();
+
+    return max && mem_budget_total() > max - max / 8;
+}
+
+char *mem_budget_format(void)
+{
+    size_t size = 48 + MEM_CATEGORIES * 48;
+    char *buf = malloc(size);
+    int len = 0, i;
+
+    if (!buf)
+        return NULL;
+    for (i = 0; i < MEM_CATEGORIES; i++)
+        len += snprintf(buf + len, size - len, "%s=%zu/%zu ",
+                        category_names[i], mem_budget_used(i),
+                        mem_budget_peak(i));
+    snprintf(buf + len, size - len, "total=%zu limit=%zu",
+             mem_budget_total(), mem_budget_limit());
+    return buf;
+}
@@ -22,6 +22,8 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <libvchan.h>
 #include <sys/select.h>
 #include <xenstore.h>
@@ -29,6 +31,27 @@
 #include "txrx.h"
 
 int double_buffered = 0;
+static void (*queue_trace_append)(int size, int queued);
+static void (*queue_trace_drain)(int count, int queued);
+static int (*write_redirect)(char *buf, int size);
+/* set from the main loop, read by the owner of the vchan (which may be the
+ * I/O thread) */
+static int write_batching;
+static long long batch_max_latency_ns;
+static long long batch_start_ns;
+/* libvchan_write() calls (each may notify the peer) and bytes written, by
+ * whichever thread owns the vchan */
+static unsigned long long vchan_writes;
+static unsigned long long vchan_write_bytes;
+/* write_data() calls dropped because the peer didn't keep up */
+static unsigned long long dropped_writes;
+
+void txrx_register_queue_trace(void (*on_append)(int size, int queued),
+                               void (*on_drain)(int count, int queued))
+{
+    queue_trace_append = on_append;
+    queue_trace_drain = on_drain;
+}
 
 static void handle_vchan_error(libvchan_t *vchan, const char *op)
 {
@@ -51,33 +74,124 @@ static int write_data_exact(libvchan_t *vchan, char *buf, int size)
         if (ret <= 0)
             handle_vchan_error(vchan, "write data");
         written += ret;
+        __atomic_add_fetch(&vchan_writes, 1, __ATOMIC_RELAXED);
     }
+    __atomic_add_fetch(&vchan_write_bytes, size, __ATOMIC_RELAXED);
 //      fprintf(stderr, "sent %d bytes\n", size);
     return size;
 }
 
+// Hand all subsequent write_data() calls to redirect instead of the vchan;
+// the new owner of the vchan writes with write_data_queued().
+void txrx_set_write_redirect(int (*redirect)(char *buf, int size))
+{
+    write_redirect = redirect;
+}
+
 int write_data(libvchan_t *vchan, char *buf, int size)
 {
-    int count;
-    if (!double_buffered)
-        return write_data_exact(vchan, buf, size); // this may block
-    double_buffer_append(buf, size);
-    count = libvchan_buffer_space(vchan);
+    if (write_redirect)
+        return write_redirect(buf, size);
+    return write_data_queued(vchan, buf, size);
+}
+
+// Each libvchan_write() may signal the peer through the event channel. In
+// batching mode data only goes to the double buffer and is written at once
+// (with a single notification) on an explicit flush, i.e. write_data() with
+// size 0, or when the oldest unflushed data gets older than max_latency_us.
+void txrx_set_write_batching(int enabled, int max_latency_us)
+{
+    __atomic_store_n(&write_batching, enabled, __ATOMIC_RELAXED);
+    __atomic_store_n(&batch_max_latency_ns, max_latency_us * 1000LL,
+                     __ATOMIC_RELAXED);
+}
+
+unsigned long long txrx_get_dropped(void)
+{
+    return __atomic_load_n(&dropped_writes, __ATOMIC_RELAXED);
+}
+
+void txrx_get_write_stats(unsigned long long *writes, unsigned long long *bytes)
+{
+    *writes = __atomic_load_n(&vchan_writes, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&vchan_write_bytes, __ATOMIC_RELAXED);
+}
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Write as much queued data as possible without blocking; the remainder
+// stays in the double buffer.
+static void write_queued_nonblock(libvchan_t *vchan)
+{
+    int count = libvchan_buffer_space(vchan);
+
     if (count > double_buffer_datacount())
         count = double_buffer_datacount();
-        // below, we write only as much data as possible without
-        // blocking; remainder of data stays in the double buffer
     write_data_exact(vchan, double_buffer_data(), count);
     double_buffer_substract(count);
+    if (queue_trace_drain && count)
+        queue_trace_drain(count, double_buffer_datacount());
+}
+
+// Never blocks once double buffered. If the buffer can't take size more
+// bytes even after handing the peer what it accepts, the data is dropped
+// (and 0 returned), so callers must pass whole messages; the owner of the
+// connection resends its state after txrx_get_dropped() changed.
+int write_data_queued(libvchan_t *vchan, char *buf, int size)
+{
+    int batching = __atomic_load_n(&write_batching, __ATOMIC_RELAXED);
+
+    if (!double_buffered)
+        return write_data_exact(vchan, buf, size); // this may block
+    if (batching && size && !double_buffer_datacount())
+        batch_start_ns = monotonic_ns();
+    if (!double_buffer_append(buf, size)) {
+        write_queued_nonblock(vchan);
+        if (!double_buffer_append(buf, size)) {
+            __atomic_add_fetch(&dropped_writes, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    if (queue_trace_append && size)
+        queue_trace_append(size, double_buffer_datacount());
+    if (batching && size && monotonic_ns() - batch_start_ns <
+        __atomic_load_n(&batch_max_latency_ns, __ATOMIC_RELAXED))
+        return size;
+    write_queued_nonblock(vchan);
+    if (batching && double_buffer_datacount())
+        // the rest waits for the peer, don't hold it back any longer
+        batch_start_ns = 0;
     return size;
 }
 
+// Header and body go out in one write_data() call, so that they are queued
+// or dropped together.
 int real_write_message(libvchan_t *vchan,
                        char *hdr, int size, char *data, int datasize)
 {
-    write_data(vchan, hdr, size);
-    write_data(vchan, data, datasize);
-    return 0;
+    char stack_buf[256];
+    char *buf = stack_buf;
+    int ret;
+
+    if (size + datasize > (int) sizeof(stack_buf)) {
+        buf = malloc(size + datasize);
+        if (!buf) {
+            fprintf(stderr, "malloc");
+            exit(1);
+        }
+    }
+    memcpy(buf, hdr, size);
+    memcpy(buf + size, data, datasize);
+    ret = write_data(vchan, buf, size + datasize);
+    if (buf != stack_buf)
+        free(buf);
+    return ret ? 0 : -1;
 }
 
 int read_data(libvchan_t *vchan, char *buf, int size)
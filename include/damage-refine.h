@@ -0,0 +1,52 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_DAMAGE_REFINE_H
+#define _QUBES_DAMAGE_REFINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "update-sched.h"
+
+#define DAMAGE_REFINE_TILE_SIZE 64
+
+typedef struct DamageRefine {
+    uint64_t *hash;     /* content hash per tile, 0 if unknown */
+    size_t size;
+    int cols, rows;
+    int width, height;
+    /* statistics, in bytes of pixel data */
+    uint64_t reported;  /* damage reported by the guest */
+    uint64_t refined;   /* ... left after dropping unchanged tiles */
+} DamageRefine;
+
+void damage_refine_resize(DamageRefine *d, int width, int height);
+void damage_refine_release(DamageRefine *d);
+/* Forget the hashes, for when pixels were sent (or dropped) without passing
+ * through damage_refine(). */
+void damage_refine_reset(DamageRefine *d);
+/* Replace the pending regions of s by the parts of them in tiles whose
+ * content changed since they were last seen. */
+void damage_refine(DamageRefine *d, UpdateSched *s, const uint8_t *data,
+                   int stride);
+
+#endif /* _QUBES_DAMAGE_REFINE_H */
@@ -19,8 +19,20 @@
  *
  */
 
+struct double_buffer_stats {
+    unsigned long long appended; /* bytes ever queued */
+    unsigned long long copied;   /* bytes moved when growing the buffer */
+    unsigned int allocations;    /* buffer (re)allocations */
+    unsigned int refused;        /* appends refused, the buffer can't grow */
+    int peak_size;               /* largest buffer allocated */
+    int peak_data;               /* most data queued at once */
+};
+
 void double_buffer_init(void);
-void double_buffer_append(char *buf, int size);
+int double_buffer_append(char *buf, int size);
 int double_buffer_datacount(void);
 char *double_buffer_data(void);
 void double_buffer_substract(int count);
+unsigned long long double_buffer_position(void);
+int double_buffer_truncate(unsigned long long pos);
+void double_buffer_get_stats(struct double_buffer_stats *stats);
@@ -0,0 +1,86 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_EVENT_LOG_H
+#define _QUBES_EVENT_LOG_H
+
+/* In-memory ring of fixed-size binary event records. Recording an event
+ * costs a clock read and a few stores; the text is only formatted when the
+ * ring is dumped (on demand, on viewer disconnect and at a failing or
+ * verbose exit). */
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum evlog_category {
+    EVLOG_INIT,
+    EVLOG_CONFIGURE,
+    EVLOG_RESIZE,
+    EVLOG_INPUT,
+    EVLOG_CATEGORY_NR
+};
+
+#define EVLOG_CAT(c) (1u << (c))
+#define EVLOG_ALL ((1u << EVLOG_CATEGORY_NR) - 1)
+
+enum evlog_event {
+    EV_INIT_START,
+    EV_INIT_VERSION_SENT,
+    EV_INIT_XCONF,
+    EV_INIT_DONE,
+    EV_DISCONNECT,
+    EV_QUEUE_STATS,
+    EV_RATE_STATS,
+    EV_CONFIGURE,
+    EV_RESIZE,
+    EV_KEY,
+    EV_BUTTON,
+    EV_KEYMAP_SYNC,
+    EV_NR
+};
+
+#define EVLOG_ARGS 6
+
+struct evlog_record {
+    uint64_t ts_ns;
+    uint32_t event;
+    int32_t arg[EVLOG_ARGS];
+};
+
+extern unsigned int evlog_mask;
+extern const uint8_t evlog_event_category[EV_NR];
+
+void evlog_emit(enum evlog_event event, const int32_t *arg);
+void evlog_set_mask(unsigned int mask);
+void evlog_dump(FILE *f);
+void evlog_init(unsigned int mask, int dump_at_exit);
+void evlog_set_dump_at_exit(int enabled);
+void evlog_queue_stats(void);
+
+/* Missing arguments are zero. The trailing 0 keeps the initializer list
+ * non-empty for events without arguments. */
+#define evlog(...) evlog_(__VA_ARGS__, 0)
+#define evlog_(event, ...) do { \
+        if (evlog_mask & EVLOG_CAT(evlog_event_category[event])) \
+            evlog_emit(event, (int32_t[EVLOG_ARGS + 1]){ __VA_ARGS__ }); \
+    } while (0)
+
+#endif /* _QUBES_EVENT_LOG_H */
@@ -0,0 +1,44 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_LATENCY_HIST_H
+#define _QUBES_LATENCY_HIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* bucket i counts samples in [2^i, 2^(i+1)) microseconds, the last one
+ * everything above */
+#define LATENCY_HIST_BUCKETS 24
+
+typedef struct LatencyHist {
+    uint64_t count[LATENCY_HIST_BUCKETS];
+    uint64_t samples;
+    uint64_t sum_us;
+    uint64_t max_us;
+} LatencyHist;
+
+void latency_hist_add(LatencyHist *h, int64_t ns);
+void latency_hist_reset(LatencyHist *h);
+/* human readable summary, returns a malloc'ed string */
+char *latency_hist_format(const LatencyHist *h);
+
+#endif /* _QUBES_LATENCY_HIST_H */
@@ -0,0 +1,56 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_MEM_BUDGET_H
+#define _QUBES_MEM_BUDGET_H
+
+#include <stddef.h>
+
+/* Memory the agent allocates, accounted by what it is used for */
+enum mem_category {
+    MEM_QUEUE,      /* outbound data not yet written to the vchan */
+    MEM_SURFACE,    /* granted display surfaces */
+    MEM_REFS,       /* grant ref arrays */
+    MEM_SCHED,      /* update scheduler tile state */
+    MEM_CATEGORIES
+};
+
+/* 0 means no limit */
+void mem_budget_set_limit(size_t limit);
+size_t mem_budget_limit(void);
+/* Account size bytes if that keeps the total within the limit, returns 0
+ * (and accounts nothing) otherwise. */
+int mem_budget_reserve(enum mem_category cat, size_t size);
+/* Account memory that can't be refused, it may exceed the limit */
+void mem_budget_add(enum mem_category cat, size_t size);
+void mem_budget_release(enum mem_category cat, size_t size);
+/* Whether size more bytes would stay within the limit, accounts nothing */
+int mem_budget_fits(size_t size);
+int mem_budget_fits_without(enum mem_category cat, size_t size);
+size_t mem_budget_used(enum mem_category cat);
+size_t mem_budget_peak(enum mem_category cat);
+size_t mem_budget_total(void);
+/* more than 7/8 of the limit in use */
+int mem_budget_pressure(void);
+/* "queue=cur/peak ... total=N limit=N", returns a malloc'ed string */
+char *mem_budget_format(void);
+
+#endif /* _QUBES_MEM_BUDGET_H */
@@ -0,0 +1,61 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_PAGE_FLIP_H
+#define _QUBES_PAGE_FLIP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "update-sched.h"
+
+/* regions the buffer misses, more than this and it's redone entirely */
+#define PAGE_FLIP_STALE_MAX 64
+
+typedef struct PageFlipBuffer {
+    uint8_t *data;
+    uint32_t *refs;
+    /* updated in the other buffer since this one was last written */
+    QubesGuiRect stale[PAGE_FLIP_STALE_MAX];
+    int nstale;
+} PageFlipBuffer;
+
+/* Two granted copies of the surface. The daemon reads from the front one
+ * while the next frame is assembled in the back one. */
+typedef struct PageFlip {
+    PageFlipBuffer buf[2];
+    int width, height;  /* 0 when not in use */
+    int front;
+} PageFlip;
+
+/* (Re)allocate both buffers for a width x height surface and fill them from
+ * src. Returns false (and leaves page flipping off) if they can't be
+ * allocated. */
+bool page_flip_resize(PageFlip *pf, int width, int height,
+                      const uint8_t *src, int stride);
+void page_flip_free(PageFlip *pf);
+bool page_flip_active(const PageFlip *pf);
+uint32_t *page_flip_front_refs(const PageFlip *pf);
+/* Bring the back buffer up to date with src for the damaged regions and make
+ * it the front one. */
+void page_flip_frame(PageFlip *pf, const uint8_t *src, int stride,
+                     const QubesGuiRect *damage, int ndamage);
+
+#endif /* _QUBES_PAGE_FLIP_H */
@@ -0,0 +1,67 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_GUI_IO_H
+#define _QUBES_GUI_IO_H
+
+/* Optional dedicated I/O thread owning the vchan (see io-thread.c) */
+
+#include <qubes-gui-protocol.h>
+#include <libvchan.h>
+
+/* Payloads of all messages the agent handles */
+typedef union QubesGuiPayload {
+    struct msg_keypress keypress;
+    struct msg_button button;
+    struct msg_motion motion;
+    struct msg_configure configure;
+    unsigned char keymap[32];
+    struct msg_xconf xconf;
+} QubesGuiPayload;
+
+/* Sent first by whichever side owns the vchan */
+#define QUBES_GUI_PROTOCOL_VERSION_STUBDOM (1 << 16 | 0)
+
+/* Pseudo message types passed from the I/O thread to the main loop */
+#define QUBESGUI_IO_XCONF       0xffff0001
+#define QUBESGUI_IO_DISCONNECT  0xffff0002
+
+typedef struct QubesGuiInMsg {
+    struct QubesGuiInMsg *next;
+    int64_t received_ns;
+    struct msg_hdr hdr;
+    QubesGuiPayload payload;
+} QubesGuiInMsg;
+
+typedef struct QubesGuiIO QubesGuiIO;
+
+/* implemented in qubes-gui.c, shared by both vchan owners */
+int qubesgui_read_message(libvchan_t *vchan, struct msg_hdr *hdr,
+                          int *data_to_discard, QubesGuiPayload *payload);
+
+QubesGuiIO *qubesgui_io_thread_start(int domid, void (*notify)(void *),
+                                     void *opaque);
+QubesGuiInMsg *qubesgui_io_thread_pop(QubesGuiIO *io);
+int qubesgui_io_thread_queued(QubesGuiIO *io);
+uint64_t qubesgui_io_thread_stream_end(QubesGuiIO *io);
+uint64_t qubesgui_io_thread_stream_sent(QubesGuiIO *io, int64_t *when_ns);
+
+#endif /* _QUBES_GUI_IO_H */
@@ -25,5 +25,10 @@
 
 extern uint32_t qubesgui_domid;
 uint8_t *qubesgui_alloc_surface_data(int width, int height, uint32_t **refs);
+/* granted buffers owned by the agent, accounted in the memory budget */
+uint8_t *qubesgui_alloc_buffer_data(int width, int height, uint32_t **refs);
+/* counterpart of qubesgui_alloc_buffer_data(), with the same size */
+void qubesgui_free_buffer_data(uint8_t *data, int width, int height,
+                               uint32_t *refs);
 
 #endif /* _QUBES_GUI_QEMU_H */
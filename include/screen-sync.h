@@ -0,0 +1,164 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_SCREEN_SYNC_H
+#define _QUBES_SCREEN_SYNC_H
+
+/* What the daemon is told about the screen and when, see screen-sync.c */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <libvchan.h>
+#include "update-sched.h"
+#include "page-flip.h"
+#include "damage-refine.h"
+
+#define QUBES_MAIN_WINDOW 1
+
+/* Surface switches closer together than this are merged into one resize.
+ * A steady stream of switches is still flushed after RESIZE_SETTLE_MAX_MS. */
+#define RESIZE_SETTLE_MS 100
+#define RESIZE_SETTLE_MAX_MS 500
+
+/* The displayed surface, as far as the daemon is concerned */
+typedef struct ScreenSyncSurface {
+    uint8_t *data;
+    int width, height;
+    int stride;
+    uint32_t *refs;     /* NULL if the pages aren't granted */
+} ScreenSyncSurface;
+
+typedef struct ScreenSyncConfig {
+    int max_pending;            /* regions collected per refresh */
+    int rate_cap_hz;
+    int repaint_queue_max;
+    bool filter_spurious;       /* drop one-line updates */
+    bool refine_damage;         /* send only tiles which changed */
+    bool page_flip;             /* tear-free output, see page-flip.c */
+} ScreenSyncConfig;
+
+/* The outbound queue, when it isn't the double buffer of this thread (the
+ * queue callbacks are NULL then), and notifications for the latency
+ * statistics. Every callback is optional. */
+typedef struct ScreenSyncOps {
+    int (*queued)(void *opaque);
+    /* position of the end of our output in the outbound stream */
+    unsigned long long (*stream_end)(void *opaque);
+    /* how much of it was handed to the vchan */
+    unsigned long long (*stream_sent)(void *opaque);
+    /* damage which is going to be sent was reported */
+    void (*damage)(void *opaque);
+    /* a MSG_SHMIMAGE was queued */
+    void (*update_queued)(void *opaque);
+} ScreenSyncOps;
+
+typedef struct ScreenSync {
+    /* NULL when the vchan is owned by the I/O thread */
+    libvchan_t *vchan;
+    const ScreenSyncOps *ops;
+    void *opaque;
+    ScreenSyncConfig config;
+
+    ScreenSyncSurface surface;
+    bool has_surface;
+    /* grant pages of surface accounted in the memory budget */
+    size_t surface_pages;
+    int x;
+    int y;
+    /* dom0 screen size from MSG_XCONF */
+    int screen_width;
+    int screen_height;
+    /* window size the guest was last asked for, see screen_sync_ui_info() */
+    int ui_width;
+    int ui_height;
+    /* ... and it differs from the surface size */
+    bool ui_pending;
+    /* the guest switched to a size it was asked for, i.e. its display
+     * driver follows the window size; kept across reconnects */
+    bool ui_followed;
+    int init_done;
+
+    UpdateSched sched;
+    UpdateRepaint repaint;
+    PageFlip flip;
+    /* end of the last flip's dump and updates in the outbound stream, the
+     * back buffer is only rewritten once they were sent */
+    unsigned long long flip_mark;
+    unsigned long long flip_frames;
+    unsigned long long flip_deferred;
+    DamageRefine refine;
+    /* damage seen since the caller last cleared it */
+    bool refresh_active;
+    /* tile state of sched and refine freed, see sync_sched_state() */
+    bool sched_state_dropped;
+    /* txrx_get_dropped() when the daemon last had our full state */
+    unsigned long long dropped_seen;
+
+    /* resize debouncing, see screen_sync_switch() */
+    int64_t resize_pending_since;
+    int resize_pending;
+    int updates_suppressed;
+    /* what the daemon was told last time */
+    int sent_width;
+    int sent_height;
+    uint32_t *sent_refs;
+    size_t sent_nrefs;
+    /* position of the last resize sequence in the outbound stream */
+    unsigned long long resize_msg_start;
+    unsigned long long resize_msg_end;
+} ScreenSync;
+
+void screen_sync_init(ScreenSync *ss, const ScreenSyncConfig *config,
+                      const ScreenSyncOps *ops, void *opaque);
+/* Takes effect at once; a page flip change resends the resize sequence */
+void screen_sync_configure(ScreenSync *ss, const ScreenSyncConfig *config);
+/* Forget what the daemon was told, before a new connection */
+void screen_sync_reset(ScreenSync *ss);
+/* The daemon sent MSG_XCONF: create the window and send the whole screen */
+void screen_sync_connect(ScreenSync *ss, int screen_width, int screen_height,
+                         const char *name);
+/* The daemon went away. The vchan, if this thread owns it, is replaced by
+ * one waiting for the next connection. Returns the problems found by
+ * screen_sync_check_resources(). */
+int screen_sync_disconnect(ScreenSync *ss);
+int screen_sync_check_resources(ScreenSync *ss);
+
+/* Damage reported by the guest */
+void screen_sync_update(ScreenSync *ss, int x, int y, int w, int h);
+/* The guest switched to surface (NULL for none). Returns when the resize
+ * should be sent with screen_sync_flush_resize(), or 0 if there is none
+ * pending. */
+int64_t screen_sync_switch(ScreenSync *ss, const ScreenSyncSurface *surface,
+                           int64_t now_ms);
+void screen_sync_flush_resize(ScreenSync *ss);
+/* The window size to ask the guest for, clamped to the dom0 screen. Returns
+ * false if there is nothing to ask for. */
+bool screen_sync_ui_info(ScreenSync *ss, int *width, int *height);
+/* End of a refresh: send the damage collected meanwhile, resync after
+ * dropped output and continue a repaint. With focus set, damage near x, y
+ * goes first. */
+void screen_sync_refresh(ScreenSync *ss, int64_t now_ms, bool focus,
+                         int x, int y);
+
+int screen_sync_queued(ScreenSync *ss);
+
+#endif /* _QUBES_SCREEN_SYNC_H */
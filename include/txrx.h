@@ -26,6 +26,11 @@
 #include <libvchan.h>
 
 int write_data(libvchan_t *vchan, char *buf, int size);
+int write_data_queued(libvchan_t *vchan, char *buf, int size);
+void txrx_set_write_redirect(int (*redirect)(char *buf, int size));
+void txrx_set_write_batching(int enabled, int max_latency_us);
+void txrx_get_write_stats(unsigned long long *writes, unsigned long long *bytes);
+unsigned long long txrx_get_dropped(void);
 int real_write_message(libvchan_t *vchan, char *hdr, int size, char *data, int datasize);
 int read_data(libvchan_t *vchan, char *buf, int size);
 #define read_struct(vchan, x) read_data(vchan, (char*)&x, sizeof(x))
@@ -38,5 +43,7 @@ void wait_for_vchan_or_argfd(libvchan_t *vchan, int nfd, int *fd, fd_set * retse
 libvchan_t *peer_server_init(int domain, int port);
 char *get_vm_name(int dom, int *target_domid);
 void vchan_register_at_eof(void (*new_vchan_at_eof)(void));
+void txrx_register_queue_trace(void (*on_append)(int size, int queued),
+                               void (*on_drain)(int count, int queued));
 
 #endif /* _QUBES_TXRX_H */
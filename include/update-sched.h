@@ -0,0 +1,95 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_UPDATE_SCHED_H
+#define _QUBES_UPDATE_SCHED_H
+
+/* Collects the damage reported during one refresh and orders it before it
+ * is sent, see update-sched.c */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPDATE_SCHED_MAX 64
+#define UPDATE_TILE_SIZE 64
+
+typedef struct UpdateTile {
+    uint32_t last_damage_ms;
+    uint32_t last_sent_ms;
+    uint16_t avg_interval_ms;
+    uint8_t held; /* damaged since last sent, held back */
+} UpdateTile;
+
+/* Per-tile update frequency, used to pace regions updating faster than
+ * cap_hz (video and the like) */
+typedef struct UpdateRateLimit {
+    UpdateTile *tiles;
+    size_t tiles_size;
+    int cols, rows;
+    int width, height;
+    int cap_hz; /* 0 disables rate limiting */
+    /* statistics */
+    int hot_tiles;      /* tiles classified as hot in the last refresh */
+    uint64_t held;      /* regions held back */
+    uint64_t paced;     /* paced regions sent for held back tiles */
+} UpdateRateLimit;
+
+typedef struct QubesGuiRect {
+    int x, y, w, h;
+} QubesGuiRect;
+
+typedef struct UpdateSched {
+    QubesGuiRect pending[UPDATE_SCHED_MAX];
+    int npending;
+    /* regions kept before merging, 0 for UPDATE_SCHED_MAX */
+    int max_pending;
+    /* inside dpy_refresh, damage is collected instead of sent */
+    bool batching;
+    UpdateRateLimit rate;
+} UpdateSched;
+
+/* Full repaint split into tiles, handed out in rings around the tile at the
+ * center of the surface */
+#define UPDATE_REPAINT_TILE_SIZE 128
+
+typedef struct UpdateRepaint {
+    int width, height;
+    int cols, rows;
+    int cx, cy;     /* center tile */
+    int ring;       /* -1 when no repaint is in progress */
+    int max_ring;
+    int index;      /* position on the current ring */
+} UpdateRepaint;
+
+void update_sched_add(UpdateSched *s, int x, int y, int w, int h);
+void update_sched_order_by_focus(UpdateSched *s, int focus_x, int focus_y);
+void update_sched_clear(UpdateSched *s);
+void update_sched_resize(UpdateSched *s, int width, int height);
+void update_sched_release(UpdateSched *s);
+void update_sched_rate_limit(UpdateSched *s, uint32_t now_ms);
+
+void update_repaint_start(UpdateRepaint *p, int width, int height);
+void update_repaint_stop(UpdateRepaint *p);
+bool update_repaint_active(const UpdateRepaint *p);
+bool update_repaint_next(UpdateRepaint *p, QubesGuiRect *r);
+
+#endif /* _QUBES_UPDATE_SCHED_H */
@@ -0,0 +1,294 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Benchmark of the outbound path of gui-common/txrx-vchan.c and the double
+ * buffer behind it, with libvchan replaced by a ring with little free space,
+ * so most writes are partial and the rest is queued. Two workloads: a
+ * stream of small messages (like MSG_SHMIMAGE) with a peer which about
+ * keeps up, and bursts of large blobs (like a clipboard paste) which the
+ * peer only drains between the bursts.
+ *
+ * Printed per workload: time per byte queued, allocations per message (all
+ * malloc() calls, counted below, and the buffer reallocations among them)
+ * and the peak memory of the queue and of the process.
+ *
+ * QUBES_GUI_BENCH_OPS and QUBES_GUI_BENCH_SPACE override the number of small
+ * messages (there are 1/256 as many blobs) and the free ring space. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <xenstore.h>
+#include "txrx.h"
+#include "double-buffer.h"
+#include "mem-budget.h"
+
+#define OPS_DEFAULT 1000000
+#define SPACE_DEFAULT 256
+#define HDR_LEN 16
+#define UPDATE_LEN 20
+#define BLOB_LEN (256 * 1024)
+#define BLOBS_PER_BURST 16
+/* what the peer reads per blob during a burst */
+#define BLOB_DRAIN 4096
+
+#define check(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                    __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+struct libvchan {
+    int space;          /* free ring space */
+    int count;          /* bytes in the ring */
+    unsigned long long written;
+    unsigned long long partial;     /* writes smaller than the queue */
+};
+
+static unsigned int seed = 1;
+static unsigned long long mallocs;
+
+/* glibc: count every allocation of the write path */
+extern void *__libc_malloc(size_t size);
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&mallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+static int random_int(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+libvchan_t *libvchan_server_init(int domain, int port, size_t read_min,
+                                 size_t write_min)
+{
+    const char *env_space = getenv("QUBES_GUI_BENCH_SPACE");
+    libvchan_t *ctrl = calloc(1, sizeof(struct libvchan));
+
+    (void) domain;
+    (void) port;
+    (void) read_min;
+    (void) write_min;
+    check(ctrl);
+    ctrl->space = env_space ? atoi(env_space) : SPACE_DEFAULT;
+    check(ctrl->space > 0);
+    return ctrl;
+}
+
+void libvchan_close(libvchan_t *ctrl)
+{
+    free(ctrl);
+}
+
+int libvchan_write(libvchan_t *ctrl, const void *data, size_t size)
+{
+    (void) data;
+    // a write which doesn't fit blocks until the peer reads
+    check(size > 0 && size <= (size_t) libvchan_buffer_space(ctrl));
+    if (size < (size_t) double_buffer_datacount())
+        ctrl->partial++;
+    ctrl->count += size;
+    ctrl->written += size;
+    return size;
+}
+
+int libvchan_read(libvchan_t *ctrl, void *data, size_t size)
+{
+    (void) data;
+    if (size > (size_t) ctrl->count)
+        size = ctrl->count;
+    ctrl->count -= size;
+    return size;
+}
+
+int libvchan_buffer_space(libvchan_t *ctrl)
+{
+    return ctrl->space - ctrl->count;
+}
+
+int libvchan_data_ready(libvchan_t *ctrl)
+{
+    return ctrl->count;
+}
+
+int libvchan_is_open(libvchan_t *ctrl)
+{
+    (void) ctrl;
+    return 1;
+}
+
+int libvchan_fd_for_select(libvchan_t *ctrl)
+{
+    (void) ctrl;
+    return -1;
+}
+
+int libvchan_wait(libvchan_t *ctrl)
+{
+    (void) ctrl;
+    return 0;
+}
+
+struct xs_handle *xs_open(unsigned long flags)
+{
+    (void) flags;
+    return NULL;
+}
+
+void xs_close(struct xs_handle *xsh)
+{
+    (void) xsh;
+}
+
+void *xs_read(struct xs_handle *h, xs_transaction_t t, const char *path,
+              unsigned int *len)
+{
+    (void) h;
+    (void) t;
+    (void) path;
+    (void) len;
+    return NULL;
+}
+
+static void peer_read(libvchan_t *vchan, int max)
+{
+    libvchan_read(vchan, NULL, max);
+}
+
+/* Let the peer take everything queued */
+static void drain(libvchan_t *vchan)
+{
+    char none[1];
+
+    while (double_buffer_datacount() || vchan->count) {
+        peer_read(vchan, vchan->space);
+        write_data(vchan, none, 0);
+    }
+}
+
+static void report(const char *name, libvchan_t *vchan,
+                   unsigned long long ops, long long ns,
+                   const struct double_buffer_stats *before,
+                   unsigned long long mallocs_before)
+{
+    struct double_buffer_stats after;
+    struct rusage usage;
+    unsigned long long bytes;
+
+    double_buffer_get_stats(&after);
+    getrusage(RUSAGE_SELF, &usage);
+    bytes = after.appended - before->appended;
+    check(vchan->written == bytes);
+    check(txrx_get_dropped() == 0);
+    printf("%s: %llu messages, %llu bytes, %.3f ns/byte, "
+           "%.4f allocations/op (%.4f buffer), %.3f bytes copied/byte, "
+           "%llu partial writes, peak queue %zu bytes, peak rss %ld KiB\n",
+           name, ops, bytes, (double) ns / bytes,
+           (double) (mallocs - mallocs_before) / ops,
+           (double) (after.allocations - before->allocations) / ops,
+           (double) (after.copied - before->copied) / bytes,
+           vchan->partial, mem_budget_peak(MEM_QUEUE), usage.ru_maxrss);
+}
+
+/* Small messages, the peer reads about half of each and catches up every
+ * 64 messages */
+static void bench_updates(unsigned long long ops)
+{
+    char hdr[HDR_LEN] = { 0 };
+    char body[UPDATE_LEN] = { 0 };
+    struct double_buffer_stats before;
+    unsigned long long i, mallocs_before;
+    libvchan_t *vchan = peer_server_init(0, 6000);
+    long long start;
+
+    double_buffer_get_stats(&before);
+    mallocs_before = mallocs;
+    start = monotonic_ns();
+    for (i = 0; i < ops; i++) {
+        check(real_write_message(vchan, hdr, sizeof(hdr),
+                                 body, sizeof(body)) == 0);
+        if (i % 64 == 63)
+            drain(vchan);
+        else
+            peer_read(vchan, random_int(HDR_LEN + UPDATE_LEN));
+    }
+    drain(vchan);
+    report("updates", vchan, ops, monotonic_ns() - start, &before,
+           mallocs_before);
+    libvchan_close(vchan);
+}
+
+/* Large blobs in bursts, queued almost entirely */
+static void bench_blobs(unsigned long long ops)
+{
+    static char blob[BLOB_LEN];
+    char hdr[HDR_LEN] = { 0 };
+    struct double_buffer_stats before;
+    unsigned long long i, mallocs_before;
+    libvchan_t *vchan = peer_server_init(0, 6000);
+    long long start;
+
+    double_buffer_get_stats(&before);
+    mallocs_before = mallocs;
+    start = monotonic_ns();
+    for (i = 0; i < ops; i++) {
+        check(real_write_message(vchan, hdr, sizeof(hdr),
+                                 blob, sizeof(blob)) == 0);
+        peer_read(vchan, BLOB_DRAIN);
+        if (i % BLOBS_PER_BURST == BLOBS_PER_BURST - 1)
+            drain(vchan);
+    }
+    drain(vchan);
+    report("blobs", vchan, ops, monotonic_ns() - start, &before,
+           mallocs_before);
+    libvchan_close(vchan);
+}
+
+int main(void)
+{
+    const char *env_ops = getenv("QUBES_GUI_BENCH_OPS");
+    unsigned long long ops = env_ops ? strtoull(env_ops, NULL, 0) :
+                             OPS_DEFAULT;
+
+    check(ops >= 256);
+    // the queue may grow as far as the double buffer allows
+    mem_budget_set_limit(0);
+    bench_updates(ops);
+    bench_blobs(ops / 256);
+    return 0;
+}
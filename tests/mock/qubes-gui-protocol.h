@@ -0,0 +1,122 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* The messages gui-agent-qemu/screen-sync.c sends, with the layout of
+ * qubes-gui-protocol.h from gui-common */
+
+#ifndef _QUBES_TEST_MOCK_QUBES_GUI_PROTOCOL_H
+#define _QUBES_TEST_MOCK_QUBES_GUI_PROTOCOL_H
+
+#include <stdint.h>
+
+struct msg_hdr {
+    uint32_t type;
+    uint32_t window;
+    uint32_t untrusted_len;
+};
+
+enum {
+    MSG_MIN = 123,
+    MSG_KEYPRESS,
+    MSG_BUTTON,
+    MSG_MOTION,
+    MSG_CROSSING,
+    MSG_FOCUS,
+    MSG_RESIZE,
+    MSG_CREATE,
+    MSG_DESTROY,
+    MSG_MAP,
+    MSG_UNMAP,
+    MSG_CONFIGURE,
+    MSG_MFNDUMP,
+    MSG_SHMIMAGE,
+    MSG_CLOSE,
+    MSG_EXECUTE,
+    MSG_CLIPBOARD_REQ,
+    MSG_CLIPBOARD_DATA,
+    MSG_WMNAME,
+    MSG_KEYMAP_NOTIFY,
+    MSG_DOCK,
+    MSG_WINDOW_HINTS,
+    MSG_WINDOW_FLAGS,
+    MSG_WINDOW_CLASS,
+    MSG_WINDOW_DUMP,
+    MSG_CURSOR,
+    MSG_MAX
+};
+
+struct msg_create {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t parent;
+    uint32_t override_redirect;
+};
+
+struct msg_map_info {
+    uint32_t transient_for;
+    uint32_t override_redirect;
+};
+
+struct msg_configure {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t override_redirect;
+};
+
+struct msg_shmimage {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct msg_wmname {
+    char data[128];
+};
+
+struct msg_window_hints {
+    uint32_t flags;
+    uint32_t min_width;
+    uint32_t min_height;
+    uint32_t max_width;
+    uint32_t max_height;
+    uint32_t width_inc;
+    uint32_t height_inc;
+    uint32_t base_width;
+    uint32_t base_height;
+};
+
+struct msg_window_dump_hdr {
+    uint32_t type;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;
+};
+
+#define MSG_WINDOW_DUMP_HDR_LEN 16
+#define WINDOW_DUMP_TYPE_GRANT_REFS 0
+#define SIZEOF_GRANT_REF 4
+
+#endif /* _QUBES_TEST_MOCK_QUBES_GUI_PROTOCOL_H */
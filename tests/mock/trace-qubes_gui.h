@@ -0,0 +1,113 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* No-op trace points of gui-agent-qemu/screen-sync.c, in place of the header
+ * tracetool generates from gui-agent-qemu/trace-events */
+
+#ifndef _QUBES_TEST_MOCK_TRACE_QUBES_GUI_H
+#define _QUBES_TEST_MOCK_TRACE_QUBES_GUI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+static inline void trace_qubesgui_pv_update(int x, int y, int w, int h)
+{
+}
+
+static inline void trace_qubesgui_pv_update_filtered(int x, int y, int w,
+                                                     int h)
+{
+}
+
+static inline void trace_qubesgui_process_pv_update(int x, int y, int w, int h,
+                                                    int queued)
+{
+}
+
+static inline void trace_qubesgui_process_pv_resize(int w, int h, int queued)
+{
+}
+
+static inline void trace_qubesgui_send_pixmap_grant_refs(int w, int h,
+                                                         size_t nrefs,
+                                                         int queued)
+{
+}
+
+static inline void trace_qubesgui_resize_deferred(int w, int h)
+{
+}
+
+static inline void trace_qubesgui_surface_not_granted(int w, int h, int stride)
+{
+}
+
+static inline void trace_qubesgui_resize_skipped(int w, int h)
+{
+}
+
+static inline void trace_qubesgui_page_flip_failed(int w, int h)
+{
+}
+
+static inline void trace_qubesgui_page_flip_deferred(int n, int queued)
+{
+}
+
+static inline void trace_qubesgui_resize_replaced(int w, int h, int queued)
+{
+}
+
+static inline void trace_qubesgui_flush_updates(int n, int focus, int x, int y)
+{
+}
+
+static inline void trace_qubesgui_updates_deferred(int n, int queued)
+{
+}
+
+static inline void trace_qubesgui_resync_dropped(uint64_t writes)
+{
+}
+
+static inline void trace_qubesgui_repaint_step(int sent, int queued, int more)
+{
+}
+
+static inline void trace_qubesgui_set_ui_info(int w, int h)
+{
+}
+
+static inline void trace_qubesgui_rate_limit(int hot_tiles, uint64_t held,
+                                             uint64_t paced)
+{
+}
+
+static inline void trace_qubesgui_damage_refine(int n, uint64_t reported,
+                                                uint64_t refined)
+{
+}
+
+static inline void trace_qubesgui_sched_state(int kept, size_t bytes)
+{
+}
+
+#endif /* _QUBES_TEST_MOCK_TRACE_QUBES_GUI_H */
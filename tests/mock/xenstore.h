@@ -0,0 +1,37 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Declarations of the xenstore API used by gui-common/txrx-vchan.c */
+
+#ifndef _QUBES_TEST_MOCK_XENSTORE_H
+#define _QUBES_TEST_MOCK_XENSTORE_H
+
+#include <stdint.h>
+
+struct xs_handle;
+typedef uint32_t xs_transaction_t;
+
+struct xs_handle *xs_open(unsigned long flags);
+void xs_close(struct xs_handle *xsh);
+void *xs_read(struct xs_handle *h, xs_transaction_t t, const char *path,
+              unsigned int *len);
+
+#endif /* _QUBES_TEST_MOCK_XENSTORE_H */
@@ -0,0 +1,173 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Standalone test of the outbound double buffer: queueing, partial drains
+ * by a slow peer, growth, truncation and the limits on growth. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "double-buffer.h"
+#include "mem-budget.h"
+
+#define BUFFER_SIZE_MIN 8192
+
+#define check(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                    __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static void fill(char *buf, int size, unsigned int seed)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = (char) (seed + i * 31);
+}
+
+static void test_append_drain(void)
+{
+    char in[3000], out[3000];
+
+    double_buffer_init();
+    check(double_buffer_datacount() == 0);
+    fill(in, sizeof(in), 1);
+    check(double_buffer_append(in, sizeof(in)));
+    check(double_buffer_datacount() == sizeof(in));
+    check(double_buffer_position() == sizeof(in));
+
+    // the peer takes a bit at a time
+    memcpy(out, double_buffer_data(), 1000);
+    double_buffer_substract(1000);
+    check(double_buffer_datacount() == 2000);
+    memcpy(out + 1000, double_buffer_data(), 2000);
+    double_buffer_substract(2000);
+    check(double_buffer_datacount() == 0);
+    check(!memcmp(in, out, sizeof(in)));
+    // draining doesn't move the stream position
+    check(double_buffer_position() == sizeof(in));
+}
+
+static void test_grow(void)
+{
+    static char big[100000];
+    char small[100];
+    struct double_buffer_stats before, after;
+
+    double_buffer_init();
+    double_buffer_get_stats(&before);
+    fill(small, sizeof(small), 2);
+    fill(big, sizeof(big), 3);
+    check(double_buffer_append(small, sizeof(small)));
+    check(double_buffer_append(big, sizeof(big)));
+    double_buffer_get_stats(&after);
+    check(after.allocations == before.allocations + 1);
+    check(after.copied == before.copied + sizeof(small));
+    check(after.peak_data >= (int) (sizeof(small) + sizeof(big)));
+    check(mem_budget_used(MEM_QUEUE) == (size_t) after.peak_size);
+    // queued data survives the reallocation
+    check(!memcmp(double_buffer_data(), small, sizeof(small)));
+    check(!memcmp(double_buffer_data() + sizeof(small), big, sizeof(big)));
+
+    // once empty, the buffer shrinks back
+    double_buffer_substract(double_buffer_datacount());
+    check(mem_budget_used(MEM_QUEUE) == BUFFER_SIZE_MIN);
+}
+
+static void test_truncate(void)
+{
+    char a[500], b[700];
+    unsigned long long pos;
+
+    double_buffer_init();
+    fill(a, sizeof(a), 4);
+    fill(b, sizeof(b), 5);
+    check(double_buffer_append(a, sizeof(a)));
+    pos = double_buffer_position();
+    check(double_buffer_append(b, sizeof(b)));
+    check(double_buffer_truncate(pos));
+    check(double_buffer_datacount() == sizeof(a));
+    check(double_buffer_position() == pos);
+    check(!memcmp(double_buffer_data(), a, sizeof(a)));
+
+    // partly handed over to the peer already
+    check(double_buffer_append(b, sizeof(b)));
+    double_buffer_substract(sizeof(a) + 100);
+    check(!double_buffer_truncate(pos));
+    check(double_buffer_datacount() == sizeof(b) - 100);
+    // not appended yet
+    check(!double_buffer_truncate(double_buffer_position() + 1));
+    check(double_buffer_truncate(double_buffer_position()));
+    check(double_buffer_datacount() == sizeof(b) - 100);
+}
+
+static void test_limits(void)
+{
+    static char big[4 << 20];
+    struct double_buffer_stats before, after;
+    unsigned long long pos;
+    int i;
+
+    double_buffer_init();
+    double_buffer_get_stats(&before);
+    // the budget refuses the growth, nothing is queued
+    mem_budget_set_limit(mem_budget_total() + 64 * 1024);
+    pos = double_buffer_position();
+    check(!double_buffer_append(big, 128 * 1024));
+    check(double_buffer_datacount() == 0);
+    check(double_buffer_position() == pos);
+    double_buffer_get_stats(&after);
+    check(after.refused == before.refused + 1);
+    check(double_buffer_append(big, 32 * 1024));
+    mem_budget_set_limit(0);
+
+    // never past BUFFER_SIZE_MAX, even without a budget
+    double_buffer_init();
+    for (i = 0; i < 2; i++)
+        check(double_buffer_append(big, sizeof(big)));
+    check(!double_buffer_append(big, sizeof(big)));
+    check(double_buffer_datacount() == 2 * (int) sizeof(big));
+}
+
+static void test_reinit(void)
+{
+    char buf[20000];
+
+    double_buffer_init();
+    check(double_buffer_append(buf, sizeof(buf)));
+    // reconnect: queued data of the old connection is dropped
+    double_buffer_init();
+    check(double_buffer_datacount() == 0);
+    check(mem_budget_used(MEM_QUEUE) == BUFFER_SIZE_MIN);
+}
+
+int main(void)
+{
+    test_append_drain();
+    test_grow();
+    test_truncate();
+    test_limits();
+    test_reinit();
+    return 0;
+}
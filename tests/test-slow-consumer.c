@@ -0,0 +1,706 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2026  Invisible Things Lab
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Soak test of the outbound path with a daemon which doesn't keep up. A
+ * simulated guest draws into a granted surface and reports damage to
+ * gui-agent-qemu/screen-sync.c, the code qubes-gui.c uses to talk to the
+ * daemon (with update-sched.c, damage-refine.c, page-flip.c, txrx-vchan.c,
+ * double-buffer.c and mem-budget.c behind it). A stand-in daemon reads the
+ * vchan at a limited rate, maps the grant refs it is sent, pauses,
+ * restarts, and sees mode switches and window resizes. Rate limiting,
+ * damage refining and page flipping are switched on and off between the
+ * drawing phases.
+ *
+ * Checked: writes never block (the mock vchan fails the test if a write
+ * doesn't fit), the daemon only sees whole and well-formed messages,
+ * screen_sync_check_resources() finds nothing on every refresh and every
+ * disconnect, and after the guest stops drawing the daemon's copy of the
+ * screen matches the surface within a bounded number of refreshes, with the
+ * outbound buffer back to its minimum size.
+ *
+ * QUBES_GUI_TEST_REFRESHES and QUBES_GUI_TEST_SEED override the length of
+ * the run and the random seed. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xenstore.h>
+#include <qubes-gui-protocol.h>
+#include "txrx.h"
+#include "double-buffer.h"
+#include "event-log.h"
+#include "mem-budget.h"
+#include "screen-sync.h"
+#include "qubes-gui-qemu.h"
+
+#define BUFFER_SIZE_MIN 8192
+#define PAGE_SIZE 4096
+#define VCHAN_RING_SIZE 4096
+#define REFRESH_MS 16
+#define RATE_CAP_HZ 20
+#define REPAINT_QUEUE_MAX 2048
+/* dom0 screen, larger than any mode */
+#define SCREEN_WIDTH 640
+#define SCREEN_HEIGHT 480
+/* memory budget beyond the surface and page flip buffers of the largest
+ * mode */
+#define QUEUE_ALLOWANCE (64 * 1024)
+/* the daemon reads up to this many bytes per refresh, half on average */
+#define DAEMON_READ_MAX 512
+#define DAEMON_PAUSE_MAX 500
+#define DAEMON_RESTART_MAX 50
+#define REFRESHES_DEFAULT 20000
+#define SEED_DEFAULT 1
+#define GUEST_COLORS 4
+/* live grants: two surfaces during a switch, two page flip buffers */
+#define GRANTS_MAX 8
+#define MSG_MAX 4096
+
+/* from /usr/include/X11/Xutil.h */
+#define PMinSize        (1L << 4)
+#define PMaxSize        (1L << 5)
+
+#define check(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s (refresh %d)\n", \
+                    __FILE__, __LINE__, #cond, refresh); \
+            exit(1); \
+        } \
+    } while (0)
+
+static const int modes[][2] = { { 320, 240 }, { 256, 192 }, { 200, 150 } };
+#define NMODES (int) (sizeof(modes) / sizeof(modes[0]))
+
+static int refresh;
+static int switches;
+static int refused_switches;
+static int restarts;
+static unsigned int seed;
+
+static ScreenSync sync;
+static const ScreenSyncOps sync_ops;
+/* the resize timer of qubes-gui.c, 0 when not armed */
+static int64_t resize_deadline;
+
+/* libvchan: a ring which the daemon below reads from */
+struct libvchan {
+    char ring[VCHAN_RING_SIZE];
+    int start, count;
+};
+
+/* Granted pages, refs are never reused */
+static struct {
+    uint8_t *data;      /* NULL for a free slot */
+    uint32_t ref;       /* of the first page, the others follow */
+    size_t pages;
+} grants[GRANTS_MAX];
+static uint32_t next_ref = 1;
+
+static struct {
+    ScreenSyncSurface surface;
+    uint32_t color;
+} guest;
+
+static struct {
+    uint32_t *screen;   /* what the user sees */
+    int width, height;  /* from the last MSG_CONFIGURE */
+    uint32_t ref;       /* first ref of the last MSG_WINDOW_DUMP, 0 if none */
+    char msg[MSG_MAX];  /* partially read message */
+    size_t msg_len;
+    int paused;         /* refreshes left */
+    int down;           /* refreshes until it is back after a restart */
+    unsigned long long messages;
+    unsigned long long dumps;
+} daemon;
+
+static int random_int(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static int64_t now_ms(void)
+{
+    return (int64_t) refresh * REFRESH_MS;
+}
+
+libvchan_t *libvchan_server_init(int domain, int port, size_t read_min,
+                                 size_t write_min)
+{
+    (void) domain;
+    (void) port;
+    (void) read_min;
+    check(write_min <= VCHAN_RING_SIZE);
+    return calloc(1, sizeof(struct libvchan));
+}
+
+void libvchan_close(libvchan_t *ctrl)
+{
+    free(ctrl);
+}
+
+int libvchan_write(libvchan_t *ctrl, const void *data, size_t size)
+{
+    size_t i;
+
+    // a write which doesn't fit blocks until the daemon reads
+    check(size > 0 && size <= (size_t) libvchan_buffer_space(ctrl));
+    for (i = 0; i < size; i++)
+        ctrl->ring[(ctrl->start + ctrl->count + i) % VCHAN_RING_SIZE] =
+            ((const char *) data)[i];
+    ctrl->count += size;
+    return size;
+}
+
+int libvchan_read(libvchan_t *ctrl, void *data, size_t size)
+{
+    size_t i;
+
+    if (size > (size_t) ctrl->count)
+        size = ctrl->count;
+    for (i = 0; i < size; i++)
+        ((char *) data)[i] = ctrl->ring[(ctrl->start + i) % VCHAN_RING_SIZE];
+    ctrl->start = (ctrl->start + size) % VCHAN_RING_SIZE;
+    ctrl->count -= size;
+    return size;
+}
+
+int libvchan_buffer_space(libvchan_t *ctrl)
+{
+    return VCHAN_RING_SIZE - ctrl->count;
+}
+
+int libvchan_data_ready(libvchan_t *ctrl)
+{
+    (void) ctrl;
+    return 0;
+}
+
+int libvchan_is_open(libvchan_t *ctrl)
+{
+    (void) ctrl;
+    return 1;
+}
+
+int libvchan_fd_for_select(libvchan_t *ctrl)
+{
+    (void) ctrl;
+    return -1;
+}
+
+int libvchan_wait(libvchan_t *ctrl)
+{
+    (void) ctrl;
+    return 0;
+}
+
+struct xs_handle *xs_open(unsigned long flags)
+{
+    (void) flags;
+    return NULL;
+}
+
+void xs_close(struct xs_handle *xsh)
+{
+    (void) xsh;
+}
+
+void *xs_read(struct xs_handle *h, xs_transaction_t t, const char *path,
+              unsigned int *len)
+{
+    (void) h;
+    (void) t;
+    (void) path;
+    (void) len;
+    return NULL;
+}
+
+static size_t surface_pages(int width, int height)
+{
+    return ((size_t) width * height * 4 + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/* The grant table */
+
+static uint8_t *grant_pages(size_t pages, uint32_t **refs)
+{
+    size_t i;
+    int slot;
+
+    for (slot = 0; slot < GRANTS_MAX && grants[slot].data; slot++)
+        ;
+    check(slot < GRANTS_MAX);
+    grants[slot].data = calloc(pages, PAGE_SIZE);
+    *refs = malloc(pages * sizeof(uint32_t));
+    check(grants[slot].data && *refs);
+    grants[slot].ref = next_ref;
+    grants[slot].pages = pages;
+    for (i = 0; i < pages; i++)
+        (*refs)[i] = next_ref++;
+    return grants[slot].data;
+}
+
+static void ungrant_pages(uint8_t *data, uint32_t *refs)
+{
+    int slot;
+
+    for (slot = 0; slot < GRANTS_MAX && grants[slot].data != data; slot++)
+        ;
+    check(slot < GRANTS_MAX);
+    free(grants[slot].data);
+    grants[slot].data = NULL;
+    free(refs);
+}
+
+/* NULL if ref isn't the first of a live grant of the given size */
+static const uint8_t *grant_map(uint32_t ref, size_t pages)
+{
+    int slot;
+
+    for (slot = 0; slot < GRANTS_MAX; slot++)
+        if (grants[slot].data && grants[slot].ref == ref) {
+            check(grants[slot].pages == pages);
+            return grants[slot].data;
+        }
+    return NULL;
+}
+
+/* As in qubes-gui.c, for page-flip.c */
+uint8_t *qubesgui_alloc_buffer_data(int width, int height, uint32_t **refs)
+{
+    size_t pages = surface_pages(width, height);
+    uint8_t *data;
+
+    if (!mem_budget_reserve(MEM_SURFACE, pages * PAGE_SIZE))
+        return NULL;
+    data = grant_pages(pages, refs);
+    mem_budget_add(MEM_REFS, pages * sizeof(uint32_t));
+    return data;
+}
+
+void qubesgui_free_buffer_data(uint8_t *data, int width, int height,
+                               uint32_t *refs)
+{
+    size_t pages;
+
+    if (!data)
+        return;
+    pages = surface_pages(width, height);
+    ungrant_pages(data, refs);
+    mem_budget_release(MEM_SURFACE, pages * PAGE_SIZE);
+    mem_budget_release(MEM_REFS, pages * sizeof(uint32_t));
+}
+
+/* The guest */
+
+static uint32_t *guest_pixel(int x, int y)
+{
+    return (uint32_t *) (guest.surface.data + (size_t) y * guest.surface.stride) +
+        x;
+}
+
+static void guest_fill(int x, int y, int w, int h)
+{
+    int i, j;
+
+    if (x + w > guest.surface.width)
+        w = guest.surface.width - x;
+    if (y + h > guest.surface.height)
+        h = guest.surface.height - y;
+    // a few colors only, so that tiles change back to content the daemon
+    // was sent before
+    guest.color = 0x10101 * (1 + random_int(GUEST_COLORS));
+    for (j = y; j < y + h; j++)
+        for (i = x; i < x + w; i++)
+            *guest_pixel(i, j) = guest.color;
+    screen_sync_update(&sync, x, y, w, h);
+}
+
+static void guest_draw(void)
+{
+    int i, n = random_int(40);
+
+    // a video in the corner, damaged on every refresh
+    guest_fill(16, 16, 48, 40);
+    for (i = 0; i < n; i++)
+        guest_fill(random_int(guest.surface.width),
+                   random_int(guest.surface.height),
+                   1 + random_int(48), 1 + random_int(48));
+    if (!random_int(200))
+        guest_fill(0, 0, guest.surface.width, guest.surface.height);
+}
+
+/* A mode switch as QEMU does it: the new surface is allocated while the old
+ * one is still displayed (and accounted), and freed after the switch.
+ * Returns false if the mode doesn't fit in the budget. */
+static bool guest_switch(int width, int height)
+{
+    size_t pages = surface_pages(width, height);
+    ScreenSyncSurface old = guest.surface;
+    int64_t deadline;
+
+    // as qubesgui_alloc_surface_data()
+    if (!mem_budget_fits_without(MEM_QUEUE, pages * PAGE_SIZE)) {
+        refused_switches++;
+        return false;
+    }
+    guest.surface.data = grant_pages(pages, &guest.surface.refs);
+    guest.surface.width = width;
+    guest.surface.height = height;
+    guest.surface.stride = width * 4;
+    deadline = screen_sync_switch(&sync, &guest.surface, now_ms());
+    if (deadline)
+        resize_deadline = deadline;
+    if (old.data)
+        ungrant_pages(old.data, old.refs);
+    switches++;
+    return true;
+}
+
+/* The daemon */
+
+static void daemon_reset(void)
+{
+    free(daemon.screen);
+    daemon.screen = NULL;
+    daemon.width = daemon.height = 0;
+    daemon.ref = 0;
+    daemon.msg_len = 0;
+}
+
+static void daemon_configure(const struct msg_configure *conf)
+{
+    int i, known = 0;
+
+    for (i = 0; i < NMODES; i++)
+        known |= (int) conf->width == modes[i][0] &&
+            (int) conf->height == modes[i][1];
+    check(known);
+    if ((int) conf->width == daemon.width &&
+        (int) conf->height == daemon.height)
+        return;
+    free(daemon.screen);
+    daemon.width = conf->width;
+    daemon.height = conf->height;
+    // nothing shown until repainted; the guest never draws this color
+    daemon.screen = malloc((size_t) daemon.width * daemon.height * 4);
+    check(daemon.screen);
+    memset(daemon.screen, 0xff, (size_t) daemon.width * daemon.height * 4);
+}
+
+static void daemon_hints(const struct msg_window_hints *hints)
+{
+    if (hints->flags & PMinSize) {
+        // the window keeps the surface size
+        check(hints->flags == (PMinSize | PMaxSize));
+        check((int) hints->min_width == daemon.width &&
+              (int) hints->min_height == daemon.height);
+        check((int) hints->max_width == daemon.width &&
+              (int) hints->max_height == daemon.height);
+    } else {
+        // the guest follows the window size
+        check(hints->flags == PMaxSize);
+        check(hints->max_width == SCREEN_WIDTH &&
+              hints->max_height == SCREEN_HEIGHT);
+    }
+}
+
+static void daemon_dump(const char *body, size_t len)
+{
+    const struct msg_window_dump_hdr *wd = (const void *) body;
+    const uint32_t *refs = (const void *) (body + MSG_WINDOW_DUMP_HDR_LEN);
+    size_t n = (len - MSG_WINDOW_DUMP_HDR_LEN) / SIZEOF_GRANT_REF, i;
+
+    check(len >= MSG_WINDOW_DUMP_HDR_LEN);
+    check(wd->type == WINDOW_DUMP_TYPE_GRANT_REFS);
+    // always preceded by MSG_CONFIGURE with the same geometry
+    check((int) wd->width == daemon.width && (int) wd->height == daemon.height);
+    check(n * SIZEOF_GRANT_REF == len - MSG_WINDOW_DUMP_HDR_LEN);
+    check(n == surface_pages(wd->width, wd->height));
+    for (i = 1; i < n; i++)
+        check(refs[i] == refs[0] + i);
+    // a dump still queued when its pages were freed can't be mapped, the
+    // daemon shows nothing until the next one
+    daemon.ref = grant_map(refs[0], n) ? refs[0] : 0;
+    daemon.dumps++;
+}
+
+static void daemon_shmimage(const struct msg_shmimage *mx)
+{
+    int x = mx->x, y = mx->y, w = mx->width, h = mx->height, j;
+    const uint8_t *data;
+
+    if (!daemon.ref)
+        return;
+    data = grant_map(daemon.ref, surface_pages(daemon.width, daemon.height));
+    if (!data)
+        return;
+    check(x >= 0 && y >= 0 && w > 0 && h > 0);
+    if (x >= daemon.width || y >= daemon.height)
+        return;
+    if (w > daemon.width - x)
+        w = daemon.width - x;
+    if (h > daemon.height - y)
+        h = daemon.height - y;
+    for (j = y; j < y + h; j++)
+        memcpy(daemon.screen + j * daemon.width + x,
+               data + ((size_t) j * daemon.width + x) * 4,
+               w * sizeof(uint32_t));
+}
+
+static void daemon_message(const struct msg_hdr *hdr, const char *body)
+{
+    check(hdr->window == QUBES_MAIN_WINDOW);
+    switch (hdr->type) {
+    case MSG_CREATE:
+        check(hdr->untrusted_len == sizeof(struct msg_create));
+        break;
+    case MSG_MAP:
+        check(hdr->untrusted_len == sizeof(struct msg_map_info));
+        break;
+    case MSG_WMNAME:
+        check(hdr->untrusted_len == sizeof(struct msg_wmname));
+        break;
+    case MSG_CONFIGURE:
+        check(hdr->untrusted_len == sizeof(struct msg_configure));
+        daemon_configure((const struct msg_configure *) body);
+        break;
+    case MSG_WINDOW_HINTS:
+        check(hdr->untrusted_len == sizeof(struct msg_window_hints));
+        daemon_hints((const struct msg_window_hints *) body);
+        break;
+    case MSG_WINDOW_DUMP:
+        daemon_dump(body, hdr->untrusted_len);
+        break;
+    case MSG_SHMIMAGE:
+        check(hdr->untrusted_len == sizeof(struct msg_shmimage));
+        check(daemon.screen);
+        daemon_shmimage((const struct msg_shmimage *) body);
+        break;
+    default:
+        check(!"unknown message type");
+    }
+    daemon.messages++;
+}
+
+static void daemon_read(libvchan_t *vchan, int max)
+{
+    struct msg_hdr *hdr = (struct msg_hdr *) daemon.msg;
+
+    while (max > 0) {
+        size_t want = sizeof(*hdr), got;
+
+        if (daemon.msg_len >= sizeof(*hdr)) {
+            check(hdr->untrusted_len <= MSG_MAX - sizeof(*hdr));
+            want += hdr->untrusted_len;
+        }
+        if ((int) (want - daemon.msg_len) > max)
+            want = daemon.msg_len + max;
+        got = libvchan_read(vchan, daemon.msg + daemon.msg_len,
+                            want - daemon.msg_len);
+        if (!got)
+            return;
+        daemon.msg_len += got;
+        max -= got;
+        if (daemon.msg_len < sizeof(*hdr) ||
+            daemon.msg_len < sizeof(*hdr) + hdr->untrusted_len)
+            continue;
+        daemon_message(hdr, daemon.msg + sizeof(*hdr));
+        daemon.msg_len = 0;
+    }
+}
+
+/* The daemon went away, whatever was queued is lost. This is what
+ * qubesgui_message_handler() does when the vchan is closed. */
+static void daemon_restart(void)
+{
+    daemon_reset();
+    check(screen_sync_disconnect(&sync) == 0);
+    daemon.down = 1 + random_int(DAEMON_RESTART_MAX);
+    restarts++;
+}
+
+static void daemon_refresh(void)
+{
+    if (daemon.down && --daemon.down)
+        return;
+    if (!sync.init_done) {
+        // as qubesgui_init_connection() after MSG_XCONF
+        resize_deadline = 0;
+        screen_sync_reset(&sync);
+        screen_sync_connect(&sync, SCREEN_WIDTH, SCREEN_HEIGHT, "test");
+    }
+    if (daemon.paused) {
+        daemon.paused--;
+        return;
+    }
+    daemon_read(sync.vchan, 1 + random_int(DAEMON_READ_MAX));
+}
+
+/* The user resizes the window to another mode, which the guest follows */
+static void window_resize(void)
+{
+    int mode = random_int(NMODES);
+    int width = modes[mode][0], height = modes[mode][1];
+
+    if (screen_sync_ui_info(&sync, &width, &height))
+        guest_switch(width, height);
+}
+
+/* The soak test */
+
+static void check_budget(void)
+{
+    check(screen_sync_check_resources(&sync) == 0);
+    // the queue may exceed the budget after a mode switch, see
+    // qubesgui_alloc_surface_data(); it is dropped rather than grown
+    check(mem_budget_total() - mem_budget_used(MEM_QUEUE) <=
+          mem_budget_limit());
+    check(mem_budget_used(MEM_QUEUE) >= BUFFER_SIZE_MIN);
+}
+
+static int caught_up(void)
+{
+    int y;
+
+    if (screen_sync_queued(&sync) || sync.vchan->count || !sync.init_done ||
+        daemon.width != guest.surface.width ||
+        daemon.height != guest.surface.height)
+        return 0;
+    for (y = 0; y < daemon.height; y++)
+        if (memcmp(daemon.screen + y * daemon.width, guest_pixel(0, y),
+                   daemon.width * 4))
+            return 0;
+    return 1;
+}
+
+static void run_refresh(bool drawing)
+{
+    int mode;
+
+    if (drawing) {
+        if (!random_int(300)) {
+            mode = random_int(NMODES);
+            guest_switch(modes[mode][0], modes[mode][1]);
+        }
+        if (!random_int(500))
+            window_resize();
+        if (!daemon.down && !random_int(2000))
+            daemon_restart();
+        if (!daemon.paused && !random_int(300))
+            daemon.paused = 1 + random_int(DAEMON_PAUSE_MAX);
+        // damage reported by the device model during the refresh
+        sync.sched.batching = true;
+        guest_draw();
+        sync.sched.batching = false;
+        // ... and from outside of it
+        if (!random_int(10))
+            guest_fill(random_int(guest.surface.width),
+                       random_int(guest.surface.height), 8, 8);
+    }
+    if (resize_deadline && now_ms() >= resize_deadline) {
+        resize_deadline = 0;
+        screen_sync_flush_resize(&sync);
+    }
+    screen_sync_refresh(&sync, now_ms(), random_int(2),
+                        random_int(guest.surface.width),
+                        random_int(guest.surface.height));
+    daemon_refresh();
+    check_budget();
+    refresh++;
+}
+
+int main(void)
+{
+    const char *env_refreshes = getenv("QUBES_GUI_TEST_REFRESHES");
+    const char *env_seed = getenv("QUBES_GUI_TEST_SEED");
+    int refreshes = env_refreshes ? atoi(env_refreshes) : REFRESHES_DEFAULT;
+    int phases = 0, catch_up = 0, catch_up_max, i, n;
+    size_t max_surface = 0, min_surface = SIZE_MAX, pages;
+    ScreenSyncConfig config = {
+        .max_pending = UPDATE_SCHED_MAX,
+        .rate_cap_hz = RATE_CAP_HZ,
+        .repaint_queue_max = REPAINT_QUEUE_MAX,
+        // the guest draws one-line updates which must arrive
+        .filter_spurious = false,
+    };
+    struct double_buffer_stats stats;
+
+    seed = env_seed ? strtoul(env_seed, NULL, 0) : SEED_DEFAULT;
+    evlog_init(EVLOG_ALL, 0);
+    for (i = 0; i < NMODES; i++) {
+        pages = surface_pages(modes[i][0], modes[i][1]);
+        if (pages > max_surface)
+            max_surface = pages;
+        if (pages < min_surface)
+            min_surface = pages;
+    }
+    // room for switching between the largest and the smallest mode, page
+    // flipping fits only with the smaller ones
+    mem_budget_set_limit((max_surface + min_surface) *
+                         (PAGE_SIZE + sizeof(uint32_t)) + QUEUE_ALLOWANCE);
+    // refreshes until the daemon catches up once the guest stopped drawing:
+    // the longest pause or restart, then draining the largest queue the
+    // budget allows at the average read rate, twice over for a resync after
+    // dropped output, plus some for pacing
+    catch_up_max = DAEMON_PAUSE_MAX + DAEMON_RESTART_MAX + 100 +
+        2 * (mem_budget_limit() - min_surface * (PAGE_SIZE + sizeof(uint32_t))) /
+        (DAEMON_READ_MAX / 2);
+    screen_sync_init(&sync, &config, &sync_ops, NULL);
+    sync.vchan = peer_server_init(0, 6000);
+    check(guest_switch(modes[0][0], modes[0][1]));
+    screen_sync_connect(&sync, SCREEN_WIDTH, SCREEN_HEIGHT, "test");
+
+    while (refresh < refreshes) {
+        // the guest draws for a while, then goes idle; without rate limiting
+        // and refining the damage the daemon falls behind quickly
+        config.rate_cap_hz = random_int(2) ? RATE_CAP_HZ : 0;
+        config.refine_damage = random_int(2);
+        config.page_flip = random_int(2);
+        screen_sync_configure(&sync, &config);
+        n = 50 + random_int(400);
+        for (i = 0; i < n; i++)
+            run_refresh(true);
+        for (i = 0; !caught_up(); i++) {
+            check(i < catch_up_max);
+            run_refresh(false);
+        }
+        if (i > catch_up)
+            catch_up = i;
+        check(mem_budget_used(MEM_QUEUE) == BUFFER_SIZE_MIN);
+        phases++;
+    }
+
+    double_buffer_get_stats(&stats);
+    printf("%d refreshes, %d idle phases, caught up within %d refreshes "
+           "(at most %d allowed)\n", refresh, phases, catch_up, catch_up_max);
+    printf("%d mode switches (%d refused), %d daemon restarts, %llu messages, "
+           "%llu dumps\n", switches, refused_switches, restarts,
+           daemon.messages, daemon.dumps);
+    printf("%llu writes dropped, %u appends refused, %llu regions held, "
+           "%llu paced, %llu page flips (%llu deferred)\n",
+           txrx_get_dropped(), stats.refused,
+           (unsigned long long) sync.sched.rate.held,
+           (unsigned long long) sync.sched.rate.paced,
+           sync.flip_frames, sync.flip_deferred);
+    return 0;
+}